@@ -21,6 +21,44 @@ PLEASE FILL OUT THIS SECTION PRIOR TO SUBMISSION
 #include <vector>
 #include <fstream>
 #include <cmath>
+#include <string>
+#include <sstream>
+#include <iomanip>
+#include <algorithm>
+#include <cstdint>
+#include <cstdlib>
+#include <cstdio>
+#include <cerrno>
+#include <cctype>
+#include <cstring>
+#include <filesystem>
+#include <chrono>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <new>
+#include <functional>
+#include <memory>
+#include <list>
+#include <map>
+#include <set>
+#include <queue>
+#include <unordered_map>
+#include <random>
+#ifdef __unix__
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#include <sys/mman.h>
+#include <sched.h>
+#endif
 using namespace std;
 
 //***************************************************************************************************//
@@ -234,613 +272,6165 @@ bool write_image(string filename, const vector<vector<Pixel>>& image)
 //***************************************************************************************************//
 
 
-// Process 1
-vector<vector<Pixel>> process_1(const vector<vector<Pixel>>& image)
-{
-    int height = image.size();
-    int width = image[0].size();
-
-    vector<vector<Pixel>> new_image(height, vector<Pixel>(width));
+// Row kernels for the process functions and the BMP codec.
+// Each kernel body is compiled once per instruction set level and the best level the
+// CPU supports is picked at startup, so one binary runs everywhere and still vectorizes.
+#if defined(__GNUC__)
+#define KERNEL_BODY static inline __attribute__((always_inline))
+#else
+#define KERNEL_BODY static inline
+#endif
 
-    for (int row = 0; row < height; row++)
-    {
-        for (int col = 0; col < width; col++)
-        {
-            int red_value = image[row][col].red;
-            int green_value = image[row][col].green;
-            int blue_value = image[row][col].blue;
+// Pointwise filters. Each filter is a small functor mapping one pixel (and its position, for
+// the filters that need it) to one output pixel; apply_pointwise() gives every filter the same
+// row loop, instruction set levels and threads. Filters whose channels all map through the
+// same function of the channel value provide channel() instead.
 
-            double distance = sqrt(pow(col - width / 2, 2) + pow(row - height / 2, 2));
-            double scaling_factor = (height - distance) / height;
+// Vignette: darken by distance from the image center. top is the image row of the first row
+// passed in, so strips of a larger image darken as the whole image would.
+struct VignetteFilter
+{
+    int width;
+    int height;
+    int top = 0;
 
-            int new_red = red_value * scaling_factor;
-            int new_green = green_value * scaling_factor;
-            int new_blue = blue_value * scaling_factor;
+    Pixel operator()(Pixel pixel, int row, int col) const
+    {
+        double dy = top + row - height / 2;
+        double dx = col - width / 2;
+        double scaling_factor = (height - sqrt(dx * dx + dy * dy)) / height;
+        return {(int)(pixel.red * scaling_factor), (int)(pixel.green * scaling_factor), (int)(pixel.blue * scaling_factor)};
+    }
+};
 
-            Pixel new_pixel;
-            new_pixel.red = new_red;
-            new_pixel.green = new_green;
-            new_pixel.blue = new_blue;
+// Clarendon: lights lighter (average of at least 170) and darks darker (average below 90).
+// Comparing the channel sum against 3 * 170 and 3 * 90 is exact and keeps the loop free
+// of floating point branches.
+struct ClarendonFilter
+{
+    double scaling_factor;
 
-            new_image[row][col] = new_pixel;
-        }
+    Pixel operator()(Pixel pixel, int, int) const
+    {
+        int sum = pixel.red + pixel.green + pixel.blue;
+        bool light = sum >= 510;
+        bool dark = sum < 270;
+        return {light ? (int)(255 - (255 - pixel.red) * scaling_factor) : dark ? (int)(pixel.red * scaling_factor) : pixel.red,
+                light ? (int)(255 - (255 - pixel.green) * scaling_factor) : dark ? (int)(pixel.green * scaling_factor) : pixel.green,
+                light ? (int)(255 - (255 - pixel.blue) * scaling_factor) : dark ? (int)(pixel.blue * scaling_factor) : pixel.blue};
     }
+};
 
-    return new_image;
-}
-
-// Process 2
-vector<vector<Pixel>> process_2(const vector<vector<Pixel>>& image, double scaling_factor)
+// Grayscale: truncating the average of integers equals integer division
+struct GrayscaleFilter
 {
-    int height = image.size();
-    int width = image[0].size();
-
-    vector<vector<Pixel>> new_image(height, vector<Pixel>(width));
+    Pixel operator()(Pixel pixel, int, int) const
+    {
+        int gray = (pixel.red + pixel.green + pixel.blue) / 3;
+        return {gray, gray, gray};
+    }
+};
 
-    for (int row = 0; row < height; row++)
+// High contrast: an average of at least 127.5 is a channel sum of at least 383
+struct HighContrastFilter
+{
+    Pixel operator()(Pixel pixel, int, int) const
     {
-        for (int col = 0; col < width; col++)
-        {
-            int red_value = image[row][col].red;
-            int green_value = image[row][col].green;
-            int blue_value = image[row][col].blue;
+        int value = pixel.red + pixel.green + pixel.blue >= 383 ? 255 : 0;
+        return {value, value, value};
+    }
+};
 
-            double average_value = (red_value + green_value + blue_value) / 3.0;
+// Lighten by a scaling factor
+struct LightenFilter
+{
+    double scaling_factor;
 
-            if (average_value >= 170)
-            {
-                int new_red = (255 - (255 - red_value) * scaling_factor);
-                int new_green = (255 - (255 - green_value) * scaling_factor);
-                int new_blue = (255 - (255 - blue_value) * scaling_factor);
+    int channel(int value) const
+    {
+        return 255 - (255 - value) * scaling_factor;
+    }
+};
 
-                Pixel new_pixel;
-                new_pixel.red = new_red;
-                new_pixel.green = new_green;
-                new_pixel.blue = new_blue;
+// Darken by a scaling factor
+struct DarkenFilter
+{
+    double scaling_factor;
 
-                new_image[row][col] = new_pixel;
-            }
-            else if (average_value <= 90)
-            {
-                int new_red = red_value * scaling_factor;
-                int new_green = green_value * scaling_factor;
-                int new_blue = blue_value * scaling_factor;
+    int channel(int value) const
+    {
+        return value * scaling_factor;
+    }
+};
 
-                Pixel new_pixel;
-                new_pixel.red = new_red;
-                new_pixel.green = new_green;
-                new_pixel.blue = new_blue;
+// Black, white, red, green, blue. Green or blue only wins as the strictly largest
+// channel; every tie for the largest channel becomes red. The conditions are computed as
+// 0 or 1 and scaled rather than selected, so the loop has no branches.
+struct PrimaryColorsFilter
+{
+    Pixel operator()(Pixel pixel, int, int) const
+    {
+        int sum = pixel.red + pixel.green + pixel.blue;
+        int white = sum >= 550;
+        int colored = sum > 150;
+        int green_max = pixel.green > pixel.red && pixel.green > pixel.blue;
+        int blue_max = pixel.blue > pixel.red && pixel.blue > pixel.green;
+        int red_max = 1 - green_max - blue_max;
+        return {255 * (white | (colored & red_max)), 255 * (white | (colored & green_max)),
+                255 * (white | (colored & blue_max))};
+    }
+};
 
-                new_image[row][col] = new_pixel;
-            }
-            else
-            {
-                int new_red = red_value;
-                int new_green = green_value;
-                int new_blue = blue_value;
+// Map every channel value through a 256-entry table per channel. Values outside 0-255
+// (processed images stay in range) use the nearest end of the table.
+struct ChannelTablesFilter
+{
+    const int* red_table;
+    const int* green_table;
+    const int* blue_table;
 
-                Pixel new_pixel;
-                new_pixel.red = new_red;
-                new_pixel.green = new_green;
-                new_pixel.blue = new_blue;
+    Pixel operator()(Pixel pixel, int, int) const
+    {
+        return {red_table[min(255, max(0, pixel.red))], green_table[min(255, max(0, pixel.green))],
+                blue_table[min(255, max(0, pixel.blue))]};
+    }
+};
 
-                new_image[row][col] = new_pixel;
-            }
+// Run a pointwise filter over rows [begin, end). The filter reads each pixel before its
+// output is stored, so image and new_image may be the same image.
+template <class Filter>
+KERNEL_BODY void pointwise_rows_body(const Filter& shared_filter, const vector<vector<Pixel>>& image,
+                                     vector<vector<Pixel>>& new_image, int begin, int end)
+{
+    // A local copy keeps the parameters in registers; stores through dst could otherwise
+    // alias the shared filter and force a reload per pixel
+    const Filter filter = shared_filter;
+    for (int row = begin; row < end; row++)
+    {
+        const Pixel* src = image[row].data();
+        Pixel* dst = new_image[row].data();
+        int width = image[row].size();
+        for (int col = 0; col < width; col++)
+        {
+            dst[col] = filter(src[col], row, col);
         }
     }
-
-    return new_image;
 }
 
-// Process 3
-vector<vector<Pixel>> process_3(const vector<vector<Pixel>>& image)
+// Convert one BMP scanline (blue, green, red bytes) to pixels
+KERNEL_BODY void unpack_bgr_row_body(const unsigned char* src, Pixel* dst, int width)
 {
-    int height = image.size();
-    int width = image[0].size();
+    for (int col = 0; col < width; col++)
+    {
+        dst[col].blue = src[3 * col];
+        dst[col].green = src[3 * col + 1];
+        dst[col].red = src[3 * col + 2];
+    }
+}
 
-    vector<vector<Pixel>> new_image(height, vector<Pixel>(width));
+// Convert pixels to one BMP scanline (blue, green, red bytes)
+KERNEL_BODY void pack_bgr_row_body(const Pixel* src, unsigned char* dst, int width)
+{
+    for (int col = 0; col < width; col++)
+    {
+        dst[3 * col] = (unsigned char)src[col].blue;
+        dst[3 * col + 1] = (unsigned char)src[col].green;
+        dst[3 * col + 2] = (unsigned char)src[col].red;
+    }
+}
 
-    for (int row = 0; row < height; row++)
+// Resample one row horizontally: every output pixel is the weighted sum of taps source pixels,
+// stored as interleaved red, green and blue floats
+KERNEL_BODY void resample_row_body(const Pixel* src, const int* index, const float* weights, int taps, float* dst, int width)
+{
+    for (int col = 0; col < width; col++)
     {
-        for (int col = 0; col < width; col++)
+        float red = 0.0f;
+        float green = 0.0f;
+        float blue = 0.0f;
+        for (int tap = 0; tap < taps; tap++)
         {
-            int red_value = image[row][col].red;
-            int green_value = image[row][col].green;
-            int blue_value = image[row][col].blue;
-
-            double gray_value = (red_value + green_value + blue_value) / 3.0;
-
-            int new_red = gray_value;
-            int new_green = gray_value;
-            int new_blue = gray_value;
-
-            Pixel new_pixel;
-            new_pixel.red = new_red;
-            new_pixel.green = new_green;
-            new_pixel.blue = new_blue;
-
-            new_image[row][col] = new_pixel;
+            const Pixel& pixel = src[index[col * taps + tap]];
+            float weight = weights[col * taps + tap];
+            red = red + weight * pixel.red;
+            green = green + weight * pixel.green;
+            blue = blue + weight * pixel.blue;
         }
+        dst[3 * col] = red;
+        dst[3 * col + 1] = green;
+        dst[3 * col + 2] = blue;
     }
-
-    return new_image;
 }
 
-// Process 4
-vector<vector<Pixel>> process_4(const vector<vector<Pixel>>& image)
+// Resample one row vertically: the weighted sum of taps horizontally resampled rows, summed
+// a whole row at a time so the loop vectorizes, then rounded and clamped to pixels
+KERNEL_BODY void resample_column_body(const float* const* rows, const float* weights, int taps, float* sums, Pixel* dst, int width)
 {
-    int height = image.size();
-    int width = image[0].size();
-
-    vector<vector<Pixel>> new_image(width, vector<Pixel>(height));
-
-    for (int row = 0; row < height; row++)
+    int count = 3 * width;
+    for (int i = 0; i < count; i++)
     {
-        for (int col = 0; col < width; col++)
+        sums[i] = weights[0] * rows[0][i];
+    }
+    for (int tap = 1; tap < taps; tap++)
+    {
+        const float* row = rows[tap];
+        float weight = weights[tap];
+        for (int i = 0; i < count; i++)
         {
-            new_image[col][(height - 1) - row] = image[row][col];
+            sums[i] = sums[i] + weight * row[i];
         }
     }
-
-    return new_image;
+    for (int col = 0; col < width; col++)
+    {
+        dst[col].red = (int)(min(255.0f, max(0.0f, sums[3 * col])) + 0.5f);
+        dst[col].green = (int)(min(255.0f, max(0.0f, sums[3 * col + 1])) + 0.5f);
+        dst[col].blue = (int)(min(255.0f, max(0.0f, sums[3 * col + 2])) + 0.5f);
+    }
 }
 
-// Process 5
-vector<vector<Pixel>> process_5(const vector<vector<Pixel>>& image, int number)
+// Differences between two images, accumulated row by row
+struct DiffStats
 {
-    int angle = number * 90;
+    int max_error = 0;
+    long long mismatches = 0;
+    unsigned long long squared_error = 0;
+};
 
-    if (angle % 90 != 0)
+// Compare two rows: largest channel error, pixels that differ and summed squared error
+KERNEL_BODY void compare_row_body(const Pixel* a, const Pixel* b, int width, DiffStats& stats)
+{
+    int max_error = 0;
+    long long mismatches = 0;
+    long long squared_error = 0;
+    for (int col = 0; col < width; col++)
     {
-        cout << "angle must be a multiple of 90 degrees." << endl;
+        int red = abs(a[col].red - b[col].red);
+        int green = abs(a[col].green - b[col].green);
+        int blue = abs(a[col].blue - b[col].blue);
+        int pixel_error = max(red, max(green, blue));
+        max_error = max(max_error, pixel_error);
+        mismatches = mismatches + (pixel_error != 0);
+        squared_error = squared_error + (red * red + green * green + blue * blue);
     }
+    stats.max_error = max(stats.max_error, max_error);
+    stats.mismatches = stats.mismatches + mismatches;
+    stats.squared_error = stats.squared_error + squared_error;
+}
 
-    int rotation = (angle % 360) / 90.0;
-    vector<vector<Pixel>> new_image = image;
+// One compiled set of row kernels
+struct PixelKernels
+{
+    const char* name;
+    void (*unpack_bgr)(const unsigned char* src, Pixel* dst, int width);
+    void (*pack_bgr)(const Pixel* src, unsigned char* dst, int width);
+    void (*compare)(const Pixel* a, const Pixel* b, int width, DiffStats& stats);
+    void (*resample_row)(const Pixel* src, const int* index, const float* weights, int taps, float* dst, int width);
+    void (*resample_column)(const float* const* rows, const float* weights, int taps, float* sums, Pixel* dst, int width);
+};
 
-    for (int i = 0; i < rotation; i++)
+// Compile every kernel body with the given function attributes. The pointwise filter loop is
+// a template, so each level gets one copy per filter.
+#define DEFINE_PIXEL_KERNELS(suffix, level_name, ATTRIBUTES) \
+    template <class Filter> ATTRIBUTES static void pointwise_rows_##suffix(const Filter& filter, \
+        const vector<vector<Pixel>>& image, vector<vector<Pixel>>& new_image, int begin, int end) \
+    { pointwise_rows_body(filter, image, new_image, begin, end); } \
+    ATTRIBUTES static void unpack_bgr_row_##suffix(const unsigned char* src, Pixel* dst, int width) \
+    { unpack_bgr_row_body(src, dst, width); } \
+    ATTRIBUTES static void pack_bgr_row_##suffix(const Pixel* src, unsigned char* dst, int width) \
+    { pack_bgr_row_body(src, dst, width); } \
+    ATTRIBUTES static void compare_row_##suffix(const Pixel* a, const Pixel* b, int width, DiffStats& stats) \
+    { compare_row_body(a, b, width, stats); } \
+    ATTRIBUTES static void resample_row_##suffix(const Pixel* src, const int* index, const float* weights, int taps, \
+        float* dst, int width) \
+    { resample_row_body(src, index, weights, taps, dst, width); } \
+    ATTRIBUTES static void resample_column_##suffix(const float* const* rows, const float* weights, int taps, \
+        float* sums, Pixel* dst, int width) \
+    { resample_column_body(rows, weights, taps, sums, dst, width); } \
+    static const PixelKernels pixel_kernels_##suffix = { \
+        level_name, unpack_bgr_row_##suffix, pack_bgr_row_##suffix, compare_row_##suffix, \
+        resample_row_##suffix, resample_column_##suffix };
+
+DEFINE_PIXEL_KERNELS(baseline, "baseline", )
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define PIXEL_KERNELS_X86 1
+DEFINE_PIXEL_KERNELS(sse42, "sse4.2", __attribute__((target("sse4.2"))))
+DEFINE_PIXEL_KERNELS(avx2, "avx2", __attribute__((target("avx2"))))
+DEFINE_PIXEL_KERNELS(avx512, "avx512", __attribute__((target("avx512f,avx512bw,avx512vl"))))
+#endif
+
+// Kernel sets from the lowest to the highest instruction set level
+vector<const PixelKernels*> available_pixel_kernels()
+{
+    vector<const PixelKernels*> levels = {&pixel_kernels_baseline};
+#ifdef PIXEL_KERNELS_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sse4.2"))
     {
-        new_image = process_4(new_image);
+        levels.push_back(&pixel_kernels_sse42);
     }
-
-    return new_image;
+    if (__builtin_cpu_supports("avx2"))
+    {
+        levels.push_back(&pixel_kernels_avx2);
+    }
+    if (__builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512bw") && __builtin_cpu_supports("avx512vl"))
+    {
+        levels.push_back(&pixel_kernels_avx512);
+    }
+#endif
+    return levels;
 }
 
-// Process 6
-vector<vector<Pixel>> process_6(const vector<vector<Pixel>>& image, int x_scale, int y_scale)
+// Pick the highest supported level, or the level named by IMAGE_PROCESSOR_SIMD
+// (baseline, sse4.2, avx2 or avx512) for testing and benchmarking
+const PixelKernels* select_pixel_kernels()
 {
-    int height = image.size();
-    int width = image[0].size();
-
-    int new_height = y_scale * height;
-    int new_width = x_scale * width;
-
-    vector<vector<Pixel>> new_image(new_height, vector<Pixel>(new_width));
-
-    for (int row = 0; row < new_height; row++)
+    vector<const PixelKernels*> levels = available_pixel_kernels();
+    const char* forced = getenv("IMAGE_PROCESSOR_SIMD");
+    if (forced == nullptr || *forced == '\0')
+    {
+        return levels.back();
+    }
+    for (const PixelKernels* level : levels)
     {
-        for (int col = 0; col < new_width; col++)
+        if (string(level->name) == forced)
         {
-            int original_x_scale = col / x_scale;
-            int original_y_scale = row / y_scale;
-
-            original_x_scale = min(original_x_scale, width - 1);
-            original_y_scale = min(original_y_scale, height - 1);
-
-            new_image[row][col] = image[original_y_scale][original_x_scale];
+            return level;
         }
     }
-
-    return new_image;
+    cerr << "Warning: IMAGE_PROCESSOR_SIMD=" << forced << " is not supported on this CPU, using "
+         << levels.back()->name << "." << endl;
+    return levels.back();
 }
 
-// Process 7
-vector<vector<Pixel>> process_7(const vector<vector<Pixel>>& image)
+// Row kernels chosen once at startup
+const PixelKernels& pixel_kernels()
 {
-    int height = image.size();
-    int width = image[0].size();
-
-    vector<vector<Pixel>> new_image(height, vector<Pixel>(width));
-
-    for (int row = 0; row < height; row++)
-    {
-        for (int col = 0; col < width; col++)
-        {
-            int red_value = image[row][col].red;
-            int green_value = image[row][col].green;
-            int blue_value = image[row][col].blue;
-
-            double gray_value = (red_value + green_value + blue_value) / 3.0;
+    static const PixelKernels* selected = select_pixel_kernels();
+    return *selected;
+}
 
-            if (gray_value >= 255 / 2.0)
-            {
-                int new_red = 255;
-                int new_green = 255;
-                int new_blue = 255;
+// Image memory (--huge-pages). A large image is thousands of separate row buffers, so with
+// 4 KB pages walking it misses the TLB at nearly every row. The image pool serves every
+// allocation of POOL_MIN_BYTES to POOL_MAX_BYTES from 32 MB blocks backed by transparent or
+// explicit 2 MB huge pages. Each thread bump-allocates from a block of its own, so the rows a
+// band allocates are contiguous and first touched by that thread; a block goes back to the
+// pool, and its memory to the system, once nothing in it is live. Everything else, and every
+// allocation while the pool is off, goes to malloc.
+#ifdef __linux__
+const size_t POOL_BLOCK_BYTES = 32 << 20;
+const size_t POOL_MIN_BYTES = 16 << 10;
+const size_t POOL_MAX_BYTES = 4 << 20;
+const size_t POOL_RESERVE_BYTES = 256ULL << 30;     // Address space only, mapped a block at a time
+
+struct PoolBlock
+{
+    atomic<long> references{0};     // Live allocations, plus one while a thread allocates from it
+    bool mapped = false;
+    PoolBlock* next_free = nullptr;
+};
 
-                Pixel new_pixel;
-                new_pixel.red = new_red;
-                new_pixel.green = new_green;
-                new_pixel.blue = new_blue;
+char* pool_base = nullptr;          // Start of the reserved range, null while the pool is off
+PoolBlock* pool_blocks = nullptr;
+size_t pool_block_count = 0;
+size_t pool_blocks_used = 0;        // Blocks handed out at least once
+PoolBlock* pool_free_blocks = nullptr;
+bool pool_explicit_pages = false;
+mutex pool_guard;
 
-                new_image[row][col] = new_pixel;
-            } else
-            {
-                int new_red = 0;
-                int new_green = 0;
-                int new_blue = 0;
+char* pool_block_memory(const PoolBlock* block)
+{
+    return pool_base + (size_t)(block - pool_blocks) * POOL_BLOCK_BYTES;
+}
 
-                Pixel new_pixel;
-                new_pixel.red = new_red;
-                new_pixel.green = new_green;
-                new_pixel.blue = new_blue;
+// Back a block with memory: explicit huge pages if asked for and the kernel has some free,
+// otherwise normal pages marked for transparent huge pages
+bool pool_map_block(char* memory)
+{
+    int flags = MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED;
+    if (pool_explicit_pages && mmap(memory, POOL_BLOCK_BYTES, PROT_READ | PROT_WRITE, flags | MAP_HUGETLB, -1, 0) != MAP_FAILED)
+    {
+        return true;
+    }
+    if (mmap(memory, POOL_BLOCK_BYTES, PROT_READ | PROT_WRITE, flags, -1, 0) == MAP_FAILED)
+    {
+        return false;
+    }
+    madvise(memory, POOL_BLOCK_BYTES, MADV_HUGEPAGE);
+    return true;
+}
 
-                new_image[row][col] = new_pixel;
-            }
-        }
+// Take a free block for the calling thread, or null if the pool is exhausted
+PoolBlock* pool_acquire_block()
+{
+    lock_guard<mutex> lock(pool_guard);
+    PoolBlock* block = pool_free_blocks;
+    if (block != nullptr)
+    {
+        pool_free_blocks = block->next_free;
+    }
+    else if (pool_blocks_used < pool_block_count)
+    {
+        block = &pool_blocks[pool_blocks_used++];
+    }
+    else
+    {
+        return nullptr;
+    }
+    if (!block->mapped && !pool_map_block(pool_block_memory(block)))
+    {
+        block->next_free = pool_free_blocks;
+        pool_free_blocks = block;
+        return nullptr;
     }
+    block->mapped = true;
+    block->references.store(1);
+    return block;
+}
 
-    return new_image;
+// Drop one reference to a block, returning its memory once the last one is gone
+void pool_unreference(PoolBlock* block)
+{
+    if (block->references.fetch_sub(1, memory_order_acq_rel) != 1)
+    {
+        return;
+    }
+    madvise(pool_block_memory(block), POOL_BLOCK_BYTES, MADV_DONTNEED);
+    lock_guard<mutex> lock(pool_guard);
+    block->next_free = pool_free_blocks;
+    pool_free_blocks = block;
 }
 
-// Process 8
-vector<vector<Pixel>> process_8(const vector<vector<Pixel>>& image, double scaling_factor)
+// The block a thread is allocating from, given up when the thread ends
+struct PoolThreadBlock
 {
-    int height = image.size();
-    int width = image[0].size();
+    PoolBlock* block = nullptr;
+    size_t used = 0;
 
-    vector<vector<Pixel>> new_image(height, vector<Pixel>(width));
+    ~PoolThreadBlock()
+    {
+        retire();
+    }
 
-    for (int row = 0; row < height; row++)
+    void retire()
     {
-        for (int col = 0; col < width; col++)
+        if (block != nullptr)
         {
-            int red_value = image[row][col].red;
-            int green_value = image[row][col].green;
-            int blue_value = image[row][col].blue;
-
-            int new_red = (255 - (255 - red_value) * scaling_factor);
-            int new_green = (255 - (255 - green_value) * scaling_factor);
-            int new_blue = (255 - (255 - blue_value) * scaling_factor);
+            pool_unreference(block);
+            block = nullptr;
+        }
+    }
+};
 
-            Pixel new_pixel;
-            new_pixel.red = new_red;
-            new_pixel.green = new_green;
-            new_pixel.blue = new_blue;
+thread_local PoolThreadBlock pool_thread_block;
 
-            new_image[row][col] = new_pixel;
+// Allocate from the calling thread's block. Returns null if the pool has no memory left.
+void* pool_allocate(size_t bytes)
+{
+    bytes = (bytes + 63) & ~(size_t)63;
+    PoolThreadBlock& current = pool_thread_block;
+    if (current.block == nullptr || current.used + bytes > POOL_BLOCK_BYTES)
+    {
+        current.retire();
+        current.block = pool_acquire_block();
+        current.used = 0;
+        if (current.block == nullptr)
+        {
+            return nullptr;
         }
     }
-
-    return new_image;
+    char* memory = pool_block_memory(current.block) + current.used;
+    current.used = current.used + bytes;
+    current.block->references.fetch_add(1, memory_order_relaxed);
+    return memory;
 }
 
-// Process 9
-vector<vector<Pixel>> process_9(const vector<vector<Pixel>>& image, double scaling_factor)
+bool in_image_pool(const void* pointer)
 {
-    int height = image.size();
-    int width = image[0].size();
+    return pool_base != nullptr && (const char*)pointer >= pool_base && (const char*)pointer < pool_base + POOL_RESERVE_BYTES;
+}
 
-    vector<vector<Pixel>> new_image(height, vector<Pixel>(width));
+// Turn the image pool on. Must be called before any other thread starts. Returns false, leaving
+// the pool off, if the address range cannot be reserved.
+bool enable_image_pool(bool explicit_pages)
+{
+    void* reserved = mmap(nullptr, POOL_RESERVE_BYTES + POOL_BLOCK_BYTES, PROT_NONE,
+                          MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (reserved == MAP_FAILED)
+    {
+        return false;
+    }
+    pool_block_count = POOL_RESERVE_BYTES / POOL_BLOCK_BYTES;
+    pool_blocks = (PoolBlock*)malloc(pool_block_count * sizeof(PoolBlock));
+    if (pool_blocks == nullptr)
+    {
+        munmap(reserved, POOL_RESERVE_BYTES + POOL_BLOCK_BYTES);
+        return false;
+    }
+    for (size_t i = 0; i < pool_block_count; i++)
+    {
+        new (&pool_blocks[i]) PoolBlock();
+    }
+    pool_explicit_pages = explicit_pages;
+    pool_base = (char*)(((uintptr_t)reserved + POOL_BLOCK_BYTES - 1) & ~(uintptr_t)(POOL_BLOCK_BYTES - 1));
+    return true;
+}
 
-    for (int row = 0; row < height; row++)
+// Every new and delete in the program goes through the pool check
+void* operator new(size_t bytes)
+{
+    if (pool_base != nullptr && bytes >= POOL_MIN_BYTES && bytes <= POOL_MAX_BYTES)
     {
-        for (int col = 0; col < width; col++)
+        void* memory = pool_allocate(bytes);
+        if (memory != nullptr)
         {
-            int red_value = image[row][col].red;
-            int green_value = image[row][col].green;
-            int blue_value = image[row][col].blue;
-
-            int new_red = red_value * scaling_factor;
-            int new_green = green_value * scaling_factor;
-            int new_blue = blue_value * scaling_factor;
-
-            Pixel new_pixel;
-            new_pixel.red = new_red;
-            new_pixel.green = new_green;
-            new_pixel.blue = new_blue;
-
-            new_image[row][col] = new_pixel;
+            return memory;
         }
     }
+    void* memory = malloc(bytes > 0 ? bytes : 1);
+    if (memory == nullptr)
+    {
+        throw bad_alloc();
+    }
+    return memory;
+}
 
-    return new_image;
+void operator delete(void* pointer) noexcept
+{
+    if (in_image_pool(pointer))
+    {
+        pool_unreference(&pool_blocks[((char*)pointer - pool_base) / POOL_BLOCK_BYTES]);
+    }
+    else
+    {
+        free(pointer);
+    }
 }
 
-// Process 10
-vector<vector<Pixel>> process_10(const vector<vector<Pixel>>& image)
+void operator delete(void* pointer, size_t) noexcept
 {
-    int height = image.size();
-    int width = image[0].size();
+    operator delete(pointer);
+}
 
-    vector<vector<Pixel>> new_image(height, vector<Pixel>(width));
+// CPUs of every NUMA node that has any, read from sysfs. Row bands are pinned to these when the
+// image pool is on and there is more than one.
+vector<cpu_set_t> numa_node_cpus;
 
-    for (int row = 0; row < height; row++)
+vector<cpu_set_t> read_numa_node_cpus()
+{
+    vector<cpu_set_t> nodes;
+    for (int node = 0; ; node++)
     {
-        for (int col = 0; col < width; col++)
+        ifstream list("/sys/devices/system/node/node" + to_string(node) + "/cpulist");
+        if (!list.is_open())
         {
-            int red_value = image[row][col].red;
-            int green_value = image[row][col].green;
-            int blue_value = image[row][col].blue;
-
-            int max_color = max(red_value, max(green_value, blue_value));
-
-            if (red_value + green_value + blue_value >= 550)
-            {
-                int new_red = 255;
-                int new_green = 255;
-                int new_blue = 255;
-
-                Pixel new_pixel;
-                new_pixel.red = new_red;
-                new_pixel.green = new_green;
-                new_pixel.blue = new_blue;
-
-                new_image[row][col] = new_pixel;
-            }
-            else if (red_value + green_value + blue_value <= 150)
-            {
-                int new_red = 0;
-                int new_green = 0;
-                int new_blue = 0;
-
-                Pixel new_pixel;
-                new_pixel.red = new_red;
-                new_pixel.green = new_green;
-                new_pixel.blue = new_blue;
-
-                new_image[row][col] = new_pixel;
-            }
-            else if (max_color == red_value)
-            {
-                int new_red = 255;
-                int new_green = 0;
-                int new_blue = 0;
-
-                Pixel new_pixel;
-                new_pixel.red = new_red;
-                new_pixel.green = new_green;
-                new_pixel.blue = new_blue;
-
-                new_image[row][col] = new_pixel;
-            }
-            else if (max_color == green_value)
+            break;
+        }
+        cpu_set_t cpus;
+        CPU_ZERO(&cpus);
+        string range;
+        while (getline(list, range, ','))
+        {
+            int first = 0;
+            int last = -1;
+            if (sscanf(range.c_str(), "%d-%d", &first, &last) == 1)
             {
-                int new_red = 0;
-                int new_green = 255;
-                int new_blue = 0;
-
-                Pixel new_pixel;
-                new_pixel.red = new_red;
-                new_pixel.green = new_green;
-                new_pixel.blue = new_blue;
-
-                new_image[row][col] = new_pixel;
+                last = first;
             }
-            else
+            for (int cpu = first; cpu <= last && cpu < CPU_SETSIZE; cpu++)
             {
-                int new_red = 0;
-                int new_green = 0;
-                int new_blue = 255;
-
-                Pixel new_pixel;
-                new_pixel.red = new_red;
-                new_pixel.green = new_green;
-                new_pixel.blue = new_blue;
-
-                new_image[row][col] = new_pixel;
+                CPU_SET(cpu, &cpus);
             }
         }
+        if (CPU_COUNT(&cpus) > 0)
+        {
+            nodes.push_back(cpus);
+        }
     }
-
-    return new_image;
+    return nodes;
 }
 
-// Run menu UI
-string menu(string filename)
+// Run the calling thread on the NUMA node that owns a band, spreading bands over the nodes in
+// order, so a band's rows are first touched and later processed on the same node
+void pin_band_to_node(int band, int bands)
 {
+    if (numa_node_cpus.size() > 1)
+    {
+        sched_setaffinity(0, sizeof(cpu_set_t), &numa_node_cpus[(long long)band * numa_node_cpus.size() / bands]);
+    }
+}
+#endif
+
+// Upper bound on worker threads chosen to fit a memory budget or a server worker's share of
+// the cores, 0 for none. Each thread has its own, so concurrent requests do not share one.
+thread_local int worker_thread_limit = 0;
+
+// Threads used for row-parallel work: IMAGE_PROCESSOR_THREADS, or one per core
+int worker_thread_count()
+{
+    static int count = []
+    {
+        const char* forced = getenv("IMAGE_PROCESSOR_THREADS");
+        if (forced != nullptr && atoi(forced) > 0)
+        {
+            return atoi(forced);
+        }
+        return (int)max(1u, thread::hardware_concurrency());
+    }();
+    return worker_thread_limit > 0 ? min(count, worker_thread_limit) : count;
+}
+
+// Split rows [0, rows) into contiguous bands, one per thread, and run body(band, begin, end)
+// on each. Small images stay on the calling thread. Returns the number of bands used.
+int parallel_for_rows(int rows, const function<void(int band, int begin, int end)>& body, int min_rows_per_band = 64)
+{
+    int bands = max(1, min(worker_thread_count(), rows / max(1, min_rows_per_band)));
+    if (bands == 1)
+    {
+        body(0, 0, rows);
+        return 1;
+    }
+
+    vector<thread> threads;
+    for (int band = 1; band < bands; band++)
+    {
+        int begin = (long long)rows * band / bands;
+        int end = (long long)rows * (band + 1) / bands;
+        threads.emplace_back([&body, band, bands, begin, end]
+        {
+#ifdef __linux__
+            pin_band_to_node(band, bands);
+#endif
+            body(band, begin, end);
+        });
+    }
+#ifdef __linux__
+    cpu_set_t caller_cpus;
+    bool pinned = numa_node_cpus.size() > 1 && sched_getaffinity(0, sizeof(caller_cpus), &caller_cpus) == 0;
+    if (pinned)
+    {
+        pin_band_to_node(0, bands);
+    }
+    body(0, 0, rows / bands);
+    if (pinned)
+    {
+        sched_setaffinity(0, sizeof(caller_cpus), &caller_cpus);
+    }
+#else
+    body(0, 0, rows / bands);
+#endif
+    for (thread& worker : threads)
+    {
+        worker.join();
+    }
+    return bands;
+}
+
+// A height x width image of zero pixels. Every row band is allocated and zeroed by the thread
+// parallel_for_rows() runs that band on, so its pages are first touched, and with --huge-pages
+// placed on the NUMA node, where the processing of the same band runs.
+vector<vector<Pixel>> make_image(int height, int width)
+{
+    vector<vector<Pixel>> image(height);
+    parallel_for_rows(height, [&](int, int begin, int end)
+    {
+        for (int row = begin; row < end; row++)
+        {
+            image[row].resize(width);
+        }
+    });
+    return image;
+}
+
+// Run a pointwise filter over rows [begin, end) with the selected instruction set level
+template <class Filter>
+void pointwise_rows(const Filter& filter, const vector<vector<Pixel>>& image, vector<vector<Pixel>>& new_image,
+                    int begin, int end)
+{
+#ifdef PIXEL_KERNELS_X86
+    const PixelKernels* kernels = &pixel_kernels();
+    if (kernels == &pixel_kernels_avx512)
+    {
+        pointwise_rows_avx512(filter, image, new_image, begin, end);
+        return;
+    }
+    if (kernels == &pixel_kernels_avx2)
+    {
+        pointwise_rows_avx2(filter, image, new_image, begin, end);
+        return;
+    }
+    if (kernels == &pixel_kernels_sse42)
+    {
+        pointwise_rows_sse42(filter, image, new_image, begin, end);
+        return;
+    }
+#endif
+    pointwise_rows_baseline(filter, image, new_image, begin, end);
+}
+
+// Adapter running a filter's channel() on each channel of a pixel. Evaluating it directly
+// vectorizes, which is faster than looking the values up in a table.
+template <class Filter>
+struct PerChannelFilter
+{
+    Filter filter;
+
+    Pixel operator()(Pixel pixel, int, int) const
+    {
+        return {filter.channel(pixel.red), filter.channel(pixel.green), filter.channel(pixel.blue)};
+    }
+};
+
+// Run a pointwise filter over the whole image in row bands
+template <class Filter>
+vector<vector<Pixel>> apply_pointwise(const vector<vector<Pixel>>& image, const Filter& filter)
+{
+    if constexpr (requires { filter.channel(0); })
+    {
+        return apply_pointwise(image, PerChannelFilter<Filter>{filter});
+    }
+    else
+    {
+        int height = image.size();
+        int width = image[0].size();
+        vector<vector<Pixel>> new_image = make_image(height, width);
+        parallel_for_rows(height, [&](int, int begin, int end)
+        {
+            pointwise_rows(filter, image, new_image, begin, end);
+        });
+        return new_image;
+    }
+}
+
+// Run a pointwise filter over the whole image in row bands, overwriting it
+template <class Filter>
+void apply_pointwise_in_place(vector<vector<Pixel>>& image, const Filter& filter)
+{
+    if constexpr (requires { filter.channel(0); })
+    {
+        apply_pointwise_in_place(image, PerChannelFilter<Filter>{filter});
+    }
+    else
+    {
+        parallel_for_rows(image.size(), [&](int, int begin, int end)
+        {
+            pointwise_rows(filter, image, image, begin, end);
+        });
+    }
+}
+
+// Geometric filters. Each filter gives the output size and the source pixel every output
+// pixel copies; apply_geometric() fills the output in row bands. Separable filters, whose
+// source row depends only on the output row and source column only on the output column,
+// provide source_row() and source_col() instead of source().
+
+// Rotate clockwise by Turns quarter turns. Half turns are separable.
+template <int Turns>
+struct QuarterTurnFilter
+{
+    static constexpr bool separable = Turns % 2 == 0;
+    int width;
+    int height;
+
+    int output_width() const
+    {
+        return separable ? width : height;
+    }
+
+    int output_height() const
+    {
+        return separable ? height : width;
+    }
+
+    int source_row(int row) const
+    {
+        return Turns == 2 ? height - 1 - row : row;
+    }
+
+    int source_col(int col) const
+    {
+        return Turns == 2 ? width - 1 - col : col;
+    }
+
+    void source(int row, int col, int& src_row, int& src_col) const
+    {
+        src_row = Turns == 1 ? height - 1 - col : col;
+        src_col = Turns == 1 ? row : width - 1 - row;
+    }
+};
+
+// Enlarge by repeating each pixel x_scale times across and y_scale times down
+struct EnlargeFilter
+{
+    static constexpr bool separable = true;
+    int width;
+    int height;
+    int x_scale;
+    int y_scale;
+
+    int output_width() const
+    {
+        return width * x_scale;
+    }
+
+    int output_height() const
+    {
+        return height * y_scale;
+    }
+
+    int source_row(int row) const
+    {
+        return row / y_scale;
+    }
+
+    int source_col(int col) const
+    {
+        return col / x_scale;
+    }
+};
+
+// Run a geometric filter. Separable filters gather each row through a table of source columns
+// built once, and copy the previous output row when the source row repeats. The others walk
+// the output in square blocks so the source rows they read stay in cache.
+template <class Filter>
+vector<vector<Pixel>> apply_geometric(const vector<vector<Pixel>>& image, const Filter& filter)
+{
+    int height = filter.output_height();
+    int width = filter.output_width();
+    vector<vector<Pixel>> new_image = make_image(height, width);
+
+    if constexpr (Filter::separable)
+    {
+        vector<int> columns(width);
+        for (int col = 0; col < width; col++)
+        {
+            columns[col] = filter.source_col(col);
+        }
+        parallel_for_rows(height, [&](int, int begin, int end)
+        {
+            for (int row = begin; row < end; row++)
+            {
+                int source_row = filter.source_row(row);
+                if (row > begin && source_row == filter.source_row(row - 1))
+                {
+                    new_image[row] = new_image[row - 1];
+                    continue;
+                }
+                const Pixel* src = image[source_row].data();
+                Pixel* dst = new_image[row].data();
+                for (int col = 0; col < width; col++)
+                {
+                    dst[col] = src[columns[col]];
+                }
+            }
+        });
+    }
+    else
+    {
+        const int BLOCK = 64;
+        parallel_for_rows(height, [&](int, int begin, int end)
+        {
+            for (int row_block = begin; row_block < end; row_block += BLOCK)
+            {
+                for (int col_block = 0; col_block < width; col_block += BLOCK)
+                {
+                    int row_end = min(row_block + BLOCK, end);
+                    int col_end = min(col_block + BLOCK, width);
+                    for (int row = row_block; row < row_end; row++)
+                    {
+                        for (int col = col_block; col < col_end; col++)
+                        {
+                            int src_row;
+                            int src_col;
+                            filter.source(row, col, src_row, src_col);
+                            new_image[row][col] = image[src_row][src_col];
+                        }
+                    }
+                }
+            }
+        });
+    }
+    return new_image;
+}
+
+// Rotate by 180 degrees in place: swapping the row vectors reverses their order without
+// moving pixels, then every row is reversed
+void half_turn_in_place(vector<vector<Pixel>>& image)
+{
+    reverse(image.begin(), image.end());
+    parallel_for_rows(image.size(), [&](int, int begin, int end)
+    {
+        for (int row = begin; row < end; row++)
+        {
+            reverse(image[row].begin(), image[row].end());
+        }
+    });
+}
+
+// Layout of the pixel array of a BMP file
+struct BmpInfo
+{
+    int start = 0;              // File offset of the pixel array
+    int width = 0;
+    int height = 0;
+    int bytes_per_pixel = 0;
+    int row_bytes = 0;          // Scanline size including padding
+};
+
+// Check the 54 header bytes of a BMP file. Accepts exactly the files read_image() accepts.
+bool parse_bmp_header(const unsigned char header[54], BmpInfo& info)
+{
+    auto field = [&](int offset, int bytes)
+    {
+        int result = 0;
+        for (int i = bytes - 1; i >= 0; i--)
+        {
+            result = result * 256 + header[offset + i];
+        }
+        return result;
+    };
+
+    int file_size = field(2, 4);
+    info.start = field(10, 4);
+    info.width = field(18, 4);
+    info.height = field(22, 4);
+    info.bytes_per_pixel = field(28, 2) / 8;
+
+    // Scan lines must occupy multiples of four bytes
+    int scanline_size = info.width * info.bytes_per_pixel;
+    info.row_bytes = scanline_size + (4 - scanline_size % 4) % 4;
+    return info.width > 0 && info.height > 0 && info.bytes_per_pixel >= 3 &&
+           file_size == info.start + info.row_bytes * info.height;
+}
+
+// Read and check a BMP header from the start of a stream. The stream is left just after the
+// 54 header bytes.
+bool read_bmp_info(istream& stream, BmpInfo& info)
+{
+    unsigned char header[54] = {0};
+    return stream.read((char*)header, sizeof(header)) && parse_bmp_header(header, info);
+}
+
+// File offset of a pixel. BMP files store rows from bottom to top.
+long long bmp_pixel_offset(const BmpInfo& info, int row, int col)
+{
+    return info.start + (long long)(info.height - 1 - row) * info.row_bytes + (long long)col * info.bytes_per_pixel;
+}
+
+// Convert count pixels of BMP bytes (3 or 4 bytes per pixel) with the row kernels
+void unpack_bmp_pixels(const unsigned char* src, Pixel* dst, int count, int bytes_per_pixel, vector<unsigned char>& packed)
+{
+    if (bytes_per_pixel != 3)
+    {
+        // Drop the alpha channel first
+        packed.resize(count * 3);
+        for (int col = 0; col < count; col++)
+        {
+            for (int i = 0; i < 3; i++)
+            {
+                packed[3 * col + i] = src[bytes_per_pixel * col + i];
+            }
+        }
+        src = packed.data();
+    }
+    pixel_kernels().unpack_bgr(src, dst, count);
+}
+
+// Faster read_image() from any input stream: reads whole scanlines front to back and converts
+// them with the row kernels. Accepts exactly the files read_image() accepts.
+vector<vector<Pixel>> read_image_fast(istream& stream)
+{
+    BmpInfo info;
+    if (!read_bmp_info(stream, info))
+    {
+        return {};
+    }
+
+    vector<vector<Pixel>> image = make_image(info.height, info.width);
+    vector<unsigned char> scanline(info.row_bytes);
+    vector<unsigned char> packed;
+
+    // Skip to the pixels without seeking, so pipes work too
+    if (info.start >= 54)
+    {
+        stream.ignore(info.start - 54);
+    }
+    else
+    {
+        stream.seekg(info.start);
+    }
+
+    // BMP files store pixels from bottom to top
+    for (int row = info.height - 1; row >= 0; row--)
+    {
+        if (!stream.read((char*)scanline.data(), scanline.size()))
+        {
+            return {};
+        }
+        unpack_bmp_pixels(scanline.data(), image[row].data(), info.width, info.bytes_per_pixel, packed);
+    }
+    return image;
+}
+
+// QOI ("Quite OK Image") files: lossless, typically well under half the size of a BMP and
+// fast to encode and decode. Chunks are tried cheapest first: a run of the previous pixel, a
+// recently seen pixel by its 6-bit hash, a small or medium difference from the previous
+// pixel, and finally the full color.
+const unsigned char QOI_OP_INDEX = 0x00;
+const unsigned char QOI_OP_DIFF = 0x40;
+const unsigned char QOI_OP_LUMA = 0x80;
+const unsigned char QOI_OP_RUN = 0xc0;
+const unsigned char QOI_OP_RGB = 0xfe;
+const unsigned char QOI_OP_RGBA = 0xff;
+const int QOI_HEADER_SIZE = 14;
+const unsigned char QOI_END_MARKER[8] = {0, 0, 0, 0, 0, 0, 0, 1};
+
+// Whether a filename has the .qoi extension (any case)
+bool is_qoi_filename(const string& filename)
+{
+    string extension = filesystem::path(filename).extension().string();
+    transform(extension.begin(), extension.end(), extension.begin(), [](unsigned char c) { return tolower(c); });
+    return extension == ".qoi";
+}
+
+// Slot of a color in the table of recently seen pixels
+inline unsigned qoi_hash(unsigned red, unsigned green, unsigned blue, unsigned alpha)
+{
+    return (red * 3 + green * 5 + blue * 7 + alpha * 11) & 63;
+}
+
+// Read the size from a QOI header. Returns false if it is not a usable QOI header, or if a
+// file of file_size bytes could not hold that many pixels (a run byte covers at most 62), so
+// a forged header is rejected before anything is allocated for it.
+bool read_qoi_size(const unsigned char* data, size_t size, size_t file_size, int& width, int& height)
+{
+    if (size < QOI_HEADER_SIZE || data[0] != 'q' || data[1] != 'o' || data[2] != 'i' || data[3] != 'f')
+    {
+        return false;
+    }
+    uint32_t w = (uint32_t)data[4] << 24 | data[5] << 16 | data[6] << 8 | data[7];
+    uint32_t h = (uint32_t)data[8] << 24 | data[9] << 16 | data[10] << 8 | data[11];
+    if (w == 0 || h == 0 || w > 1000000 || h > 1000000 || (data[12] != 3 && data[12] != 4))
+    {
+        return false;
+    }
+    if (file_size < QOI_HEADER_SIZE || (unsigned long long)w * h > (file_size - QOI_HEADER_SIZE) * 62ULL)
+    {
+        return false;
+    }
+    width = w;
+    height = h;
+    return true;
+}
+
+// Decode a whole QOI file held in memory. Any alpha channel is dropped.
+vector<vector<Pixel>> decode_qoi(const unsigned char* data, size_t size)
+{
+    int width;
+    int height;
+    if (!read_qoi_size(data, size, size, width, height))
+    {
+        return {};
+    }
+
+    // Colors are packed as red | green << 8 | blue << 16 | alpha << 24
+    vector<vector<Pixel>> image = make_image(height, width);
+    uint32_t index[64] = {0};
+    uint32_t color = 0xff000000u;
+    int run = 0;
+
+    // Every chunk is at most 5 bytes, so only the last few need a bounds check
+    const unsigned char* in = data + QOI_HEADER_SIZE;
+    const unsigned char* end = data + size;
+    for (int row = 0; row < height; row++)
+    {
+        Pixel* out = image[row].data();
+        for (int col = 0; col < width; col++)
+        {
+            if (run > 0)
+            {
+                run--;
+            }
+            else
+            {
+                if (end - in < 5)
+                {
+                    return {};
+                }
+                unsigned op = *in++;
+                if (op < QOI_OP_RUN)
+                {
+                    unsigned red = color & 0xff;
+                    unsigned green = color >> 8 & 0xff;
+                    unsigned blue = color >> 16 & 0xff;
+                    if (op < QOI_OP_DIFF)
+                    {
+                        color = index[op];
+                        out[col] = {(int)(color & 0xff), (int)(color >> 8 & 0xff), (int)(color >> 16 & 0xff)};
+                        continue;
+                    }
+                    if (op < QOI_OP_LUMA)
+                    {
+                        red = (red + (op >> 4 & 3) - 2) & 0xff;
+                        green = (green + (op >> 2 & 3) - 2) & 0xff;
+                        blue = (blue + (op & 3) - 2) & 0xff;
+                    }
+                    else
+                    {
+                        int green_diff = (int)(op & 0x3f) - 32;
+                        red = (red + green_diff - 8 + (*in >> 4)) & 0xff;
+                        green = (green + green_diff) & 0xff;
+                        blue = (blue + green_diff - 8 + (*in & 0x0f)) & 0xff;
+                        in++;
+                    }
+                    color = (color & 0xff000000u) | red | green << 8 | blue << 16;
+                }
+                else if (op == QOI_OP_RGB)
+                {
+                    color = (color & 0xff000000u) | in[0] | in[1] << 8 | in[2] << 16;
+                    in += 3;
+                }
+                else if (op == QOI_OP_RGBA)
+                {
+                    color = in[0] | in[1] << 8 | in[2] << 16 | (uint32_t)in[3] << 24;
+                    in += 4;
+                }
+                else
+                {
+                    // The run includes this pixel, which repeats the previous one
+                    run = op & 0x3f;
+                }
+                index[qoi_hash(color & 0xff, color >> 8 & 0xff, color >> 16 & 0xff, color >> 24)] = color;
+            }
+            out[col] = {(int)(color & 0xff), (int)(color >> 8 & 0xff), (int)(color >> 16 & 0xff)};
+        }
+    }
+    return image;
+}
+
+// Read everything left in a stream
+string read_stream(istream& stream)
+{
+    string data;
+    vector<char> buffer(1 << 16);
+    while (stream.read(buffer.data(), buffer.size()) || stream.gcount() > 0)
+    {
+        data.append(buffer.data(), stream.gcount());
+    }
+    return data;
+}
+
+// Read a whole QOI stream and decode it
+vector<vector<Pixel>> read_qoi(istream& stream)
+{
+    string data = read_stream(stream);
+    return decode_qoi((const unsigned char*)data.data(), data.size());
+}
+
+// Encode an image as a 3-channel QOI file in memory. Channel values are truncated to bytes
+// like write_image() does.
+void encode_qoi(const vector<vector<Pixel>>& image, vector<unsigned char>& bytes)
+{
+    int width = image[0].size();
+    int height = image.size();
+
+    // Worst case: every pixel a 4-byte QOI_OP_RGB chunk
+    bytes.resize(QOI_HEADER_SIZE + (size_t)width * height * 4 + sizeof(QOI_END_MARKER));
+    unsigned char* out = bytes.data();
+    const unsigned char header[QOI_HEADER_SIZE] = {
+        'q', 'o', 'i', 'f',
+        (unsigned char)(width >> 24), (unsigned char)(width >> 16), (unsigned char)(width >> 8), (unsigned char)width,
+        (unsigned char)(height >> 24), (unsigned char)(height >> 16), (unsigned char)(height >> 8), (unsigned char)height,
+        3, 0};
+    memcpy(out, header, QOI_HEADER_SIZE);
+    out += QOI_HEADER_SIZE;
+
+    // Colors are packed as red | green << 8 | blue << 16 | alpha << 24. Alpha is always 255,
+    // so the all-zero initial table entries never match.
+    uint32_t index[64] = {0};
+    uint32_t previous = 0xff000000u;
+    int run = 0;
+
+    for (int row = 0; row < height; row++)
+    {
+        const Pixel* in = image[row].data();
+        for (int col = 0; col < width; col++)
+        {
+            unsigned red = (unsigned char)in[col].red;
+            unsigned green = (unsigned char)in[col].green;
+            unsigned blue = (unsigned char)in[col].blue;
+            uint32_t color = red | green << 8 | blue << 16 | 0xff000000u;
+            if (color == previous)
+            {
+                run++;
+                if (run == 62)
+                {
+                    *out++ = QOI_OP_RUN | (run - 1);
+                    run = 0;
+                }
+                continue;
+            }
+            if (run > 0)
+            {
+                *out++ = QOI_OP_RUN | (run - 1);
+                run = 0;
+            }
+
+            unsigned slot = qoi_hash(red, green, blue, 255);
+            if (index[slot] == color)
+            {
+                *out++ = QOI_OP_INDEX | slot;
+            }
+            else
+            {
+                index[slot] = color;
+                signed char red_diff = red - (previous & 0xff);
+                signed char green_diff = green - (previous >> 8 & 0xff);
+                signed char blue_diff = blue - (previous >> 16 & 0xff);
+                signed char red_green = red_diff - green_diff;
+                signed char blue_green = blue_diff - green_diff;
+                if (red_diff >= -2 && red_diff <= 1 && green_diff >= -2 && green_diff <= 1 && blue_diff >= -2 && blue_diff <= 1)
+                {
+                    *out++ = QOI_OP_DIFF | (red_diff + 2) << 4 | (green_diff + 2) << 2 | (blue_diff + 2);
+                }
+                else if (green_diff >= -32 && green_diff <= 31 && red_green >= -8 && red_green <= 7 &&
+                         blue_green >= -8 && blue_green <= 7)
+                {
+                    *out++ = QOI_OP_LUMA | (green_diff + 32);
+                    *out++ = (red_green + 8) << 4 | (blue_green + 8);
+                }
+                else
+                {
+                    out[0] = QOI_OP_RGB;
+                    out[1] = red;
+                    out[2] = green;
+                    out[3] = blue;
+                    out += 4;
+                }
+            }
+            previous = color;
+        }
+    }
+    if (run > 0)
+    {
+        *out++ = QOI_OP_RUN | (run - 1);
+    }
+    memcpy(out, QOI_END_MARKER, sizeof(QOI_END_MARKER));
+    out += sizeof(QOI_END_MARKER);
+    bytes.resize(out - bytes.data());
+}
+
+// Write an image to a stream as QOI
+bool write_qoi(ostream& stream, const vector<vector<Pixel>>& image)
+{
+    if (image.empty() || image[0].empty())
+    {
+        return false;
+    }
+    vector<unsigned char> bytes;
+    encode_qoi(image, bytes);
+    stream.write((const char*)bytes.data(), bytes.size());
+    return stream.good();
+}
+
+#ifdef __unix__
+// Rows per thread for parallel file I/O, so every band moves at least about a megabyte
+int io_rows_per_band(const BmpInfo& info)
+{
+    return max(64, (1 << 20) / info.row_bytes);
+}
+
+// pread() until all bytes arrive
+bool pread_all(int fd, unsigned char* data, size_t bytes, off_t offset)
+{
+    while (bytes > 0)
+    {
+        ssize_t count = pread(fd, data, bytes, offset);
+        if (count <= 0)
+        {
+            if (count < 0 && errno == EINTR)
+            {
+                continue;
+            }
+            return false;
+        }
+        data = data + count;
+        bytes = bytes - count;
+        offset = offset + count;
+    }
+    return true;
+}
+
+// pwrite() until all bytes are written
+bool pwrite_all(int fd, const unsigned char* data, size_t bytes, off_t offset)
+{
+    while (bytes > 0)
+    {
+        ssize_t count = pwrite(fd, data, bytes, offset);
+        if (count <= 0)
+        {
+            if (count < 0 && errno == EINTR)
+            {
+                continue;
+            }
+            return false;
+        }
+        data = data + count;
+        bytes = bytes - count;
+        offset = offset + count;
+    }
+    return true;
+}
+
+// Decode a BMP file with a thread per row band. A band is one contiguous stretch of the pixel
+// array, read with pread() at its own offset a megabyte at a time and converted straight into
+// its rows, which the band also allocates. Gives the same result as read_image_fast().
+vector<vector<Pixel>> read_bmp_file_parallel(const string& filename)
+{
+    int fd = open(filename.c_str(), O_RDONLY);
+    if (fd < 0)
+    {
+        return {};
+    }
+    unsigned char header[54];
+    BmpInfo info;
+    struct stat status;
+    if (!pread_all(fd, header, sizeof(header), 0) || !parse_bmp_header(header, info) || fstat(fd, &status) != 0 ||
+        status.st_size < info.start + (long long)info.row_bytes * info.height)
+    {
+        close(fd);
+        return {};
+    }
+
+    vector<vector<Pixel>> image(info.height);
+    vector<char> failed(worker_thread_count(), 0);
+    int chunk_rows = max(1, (1 << 20) / info.row_bytes);
+    parallel_for_rows(info.height, [&](int band, int begin, int end)
+    {
+        vector<unsigned char> buffer;
+        vector<unsigned char> packed;
+
+        // The band's bottom row comes first in the file
+        for (int last = end; last > begin; last = last - chunk_rows)
+        {
+            int first = max(begin, last - chunk_rows);
+            buffer.resize((size_t)(last - first) * info.row_bytes);
+            if (!pread_all(fd, buffer.data(), buffer.size(), bmp_pixel_offset(info, last - 1, 0)))
+            {
+                failed[band] = 1;
+                return;
+            }
+            for (int row = last - 1; row >= first; row--)
+            {
+                image[row].resize(info.width);
+                unpack_bmp_pixels(&buffer[(size_t)(last - 1 - row) * info.row_bytes], image[row].data(), info.width,
+                                  info.bytes_per_pixel, packed);
+            }
+        }
+    }, io_rows_per_band(info));
+    close(fd);
+
+    if (find(failed.begin(), failed.end(), 1) != failed.end())
+    {
+        return {};
+    }
+    return image;
+}
+#endif
+
+// Read an image file: QOI for a .qoi filename, otherwise BMP
+vector<vector<Pixel>> read_image_fast(const string& filename)
+{
+    ifstream stream(filename, ios::binary);
+    if (is_qoi_filename(filename))
+    {
+        return read_qoi(stream);
+    }
+#ifdef __unix__
+    return read_bmp_file_parallel(filename);
+#else
+    return read_image_fast(stream);
+#endif
+}
+
+// A rectangle of pixels with a top-left origin. An empty region stands for the whole image.
+struct Region
+{
+    int x = 0;
+    int y = 0;
+    int width = 0;
+    int height = 0;
+
+    bool empty() const
+    {
+        return width <= 0 || height <= 0;
+    }
+};
+
+// Parse a region written as "x,y,width,height"
+bool parse_region(const string& text, Region& region)
+{
+    istringstream in(text);
+    Region parsed;
+    char separators[3] = {0};
+    if (!(in >> parsed.x >> separators[0] >> parsed.y >> separators[1] >> parsed.width >> separators[2] >> parsed.height))
+    {
+        return false;
+    }
+    in >> ws;
+    if (!in.eof() || separators[0] != ',' || separators[1] != ',' || separators[2] != ',' ||
+        parsed.x < 0 || parsed.y < 0 || parsed.empty())
+    {
+        return false;
+    }
+    region = parsed;
+    return true;
+}
+
+// Clip a region to an image of the given size. Returns false if nothing is left.
+bool clip_region(Region& region, int width, int height)
+{
+    region.width = min(region.width, width - region.x);
+    region.height = min(region.height, height - region.y);
+    return !region.empty();
+}
+
+// Copy a region out of an image. The region is clipped to the image first.
+vector<vector<Pixel>> crop_image(const vector<vector<Pixel>>& image, Region& region)
+{
+    if (!clip_region(region, image[0].size(), image.size()))
+    {
+        return {};
+    }
+    vector<vector<Pixel>> cropped(region.height);
+    for (int row = 0; row < region.height; row++)
+    {
+        const vector<Pixel>& source = image[region.y + row];
+        cropped[row].assign(source.begin() + region.x, source.begin() + region.x + region.width);
+    }
+    return cropped;
+}
+
+// Decode the pixels of a region (already inside the image) from an open BMP stream
+vector<vector<Pixel>> read_bmp_region(istream& stream, const BmpInfo& info, const Region& region)
+{
+    vector<vector<Pixel>> image = make_image(region.height, region.width);
+    vector<unsigned char> bytes(region.width * info.bytes_per_pixel);
+    vector<unsigned char> packed;
+
+    // Bottom row first, so reads move forward through the file
+    for (int row = region.y + region.height - 1; row >= region.y; row--)
+    {
+        stream.seekg(bmp_pixel_offset(info, row, region.x));
+        if (!stream.read((char*)bytes.data(), bytes.size()))
+        {
+            return {};
+        }
+        unpack_bmp_pixels(bytes.data(), image[row - region.y].data(), region.width, info.bytes_per_pixel, packed);
+    }
+    return image;
+}
+
+// Decode only the scanlines and bytes a region covers, so the cost follows the region's
+// area instead of the image size. The region is clipped to the image first.
+vector<vector<Pixel>> read_image_region(const string& filename, Region& region)
+{
+    // QOI has no random access, so the whole image is decoded
+    if (is_qoi_filename(filename))
+    {
+        vector<vector<Pixel>> image = read_image_fast(filename);
+        return image.empty() ? image : crop_image(image, region);
+    }
+
+    ifstream stream(filename, ios::binary);
+    BmpInfo info;
+    if (!read_bmp_info(stream, info) || !clip_region(region, info.width, info.height))
+    {
+        return {};
+    }
+    return read_bmp_region(stream, info, region);
+}
+
+// Rows of a BMP stream for a series of regions moving up the image, as strips do. Rows are
+// read on through the file (BMP files store the bottom row first) and the top rows of each
+// region can be kept for the overlap with the next, so a forward-only stream such as a pipe
+// works as long as every region starts within the rows kept. Seekable streams may jump
+// anywhere and read narrow regions without whole scanlines.
+class BmpRowSource
+{
+public:
+    // The stream must be positioned just after the header read by read_bmp_info()
+    BmpRowSource(istream& stream, const BmpInfo& info, bool seekable)
+        : stream(stream), info(info), seekable(seekable), next_row(info.height - 1), at_pixels(false) {}
+
+    // Decode a region inside the image, keeping its top keep_rows rows for the next call.
+    // Returns an empty image if it cannot be read.
+    vector<vector<Pixel>> read(const Region& region, int keep_rows = 0)
+    {
+        if (seekable && region.width < info.width)
+        {
+            return read_bmp_region(stream, info, region);
+        }
+        if (!at_pixels && !skip_to_pixels())
+        {
+            return {};
+        }
+
+        vector<vector<Pixel>> rows(region.height);
+        map<int, vector<Pixel>> kept;
+        for (int row = region.y + region.height - 1; row >= region.y; row--)
+        {
+            vector<Pixel> full;
+            auto found = buffered.find(row);
+            if (found != buffered.end())
+            {
+                full.swap(found->second);
+            }
+            else if (!read_row(row, full))
+            {
+                return {};
+            }
+            vector<Pixel>& out = rows[row - region.y];
+            if (row < region.y + keep_rows)
+            {
+                out.assign(full.begin() + region.x, full.begin() + region.x + region.width);
+                kept[row].swap(full);
+            }
+            else if (region.width == info.width)
+            {
+                out.swap(full);
+            }
+            else
+            {
+                out.assign(full.begin() + region.x, full.begin() + region.x + region.width);
+            }
+        }
+        buffered.swap(kept);
+        return rows;
+    }
+
+private:
+    // Move from the end of the header to the first scanline
+    bool skip_to_pixels()
+    {
+        if (info.start >= 54)
+        {
+            stream.ignore(info.start - 54);
+        }
+        else if (!seekable || !stream.seekg(info.start))
+        {
+            return false;
+        }
+        at_pixels = true;
+        return true;
+    }
+
+    // Decode one whole row, skipping forward (or seeking back, if allowed) to it
+    bool read_row(int row, vector<Pixel>& pixels)
+    {
+        if (row > next_row)
+        {
+            if (!seekable)
+            {
+                return false;
+            }
+            stream.clear();
+            stream.seekg(bmp_pixel_offset(info, row, 0));
+            next_row = row;
+        }
+        scanline.resize(info.row_bytes);
+        while (next_row >= row)
+        {
+            if (!stream.read((char*)scanline.data(), scanline.size()))
+            {
+                return false;
+            }
+            next_row--;
+        }
+        pixels.resize(info.width);
+        unpack_bmp_pixels(scanline.data(), pixels.data(), info.width, info.bytes_per_pixel, packed);
+        return true;
+    }
+
+    istream& stream;
+    BmpInfo info;
+    bool seekable;
+    int next_row;               // Next row in file order
+    bool at_pixels;
+    map<int, vector<Pixel>> buffered;
+    vector<unsigned char> scanline;
+    vector<unsigned char> packed;
+};
+
+// Overwrite the pixels of a region inside an existing BMP file, leaving every other byte
+// (including any alpha channel) as it was
+bool write_image_region(const string& filename, const Region& region, const vector<vector<Pixel>>& pixels)
+{
+    fstream stream(filename, ios::in | ios::out | ios::binary);
+    BmpInfo info;
+    if (!read_bmp_info(stream, info) || region.empty() || region.x + region.width > info.width ||
+        region.y + region.height > info.height || (int)pixels.size() != region.height ||
+        (int)pixels[0].size() != region.width)
+    {
+        return false;
+    }
+
+    vector<unsigned char> bytes(region.width * info.bytes_per_pixel);
+    vector<unsigned char> packed(region.width * 3);
+    const PixelKernels& kernels = pixel_kernels();
+    for (int row = region.y + region.height - 1; row >= region.y; row--)
+    {
+        long long offset = bmp_pixel_offset(info, row, region.x);
+        const vector<Pixel>& source = pixels[row - region.y];
+        if (info.bytes_per_pixel == 3)
+        {
+            kernels.pack_bgr(source.data(), bytes.data(), region.width);
+        }
+        else
+        {
+            stream.seekg(offset);
+            stream.read((char*)bytes.data(), bytes.size());
+            kernels.pack_bgr(source.data(), packed.data(), region.width);
+            for (int col = 0; col < region.width; col++)
+            {
+                for (int i = 0; i < 3; i++)
+                {
+                    bytes[info.bytes_per_pixel * col + i] = packed[3 * col + i];
+                }
+            }
+        }
+        stream.seekp(offset);
+        stream.write((char*)bytes.data(), bytes.size());
+    }
+    return stream.good();
+}
+
+// Write the 54 header bytes of a 24-bit BMP file, the same header write_image() produces
+void write_bmp_header(ostream& stream, int width, int height)
+{
+    int padding = (4 - width * 3 % 4) % 4;
+    int array_bytes = (width * 3 + padding) * height;
+
+    const int BMP_HEADER_SIZE = 14;
+    const int DIB_HEADER_SIZE = 40;
+    unsigned char header[BMP_HEADER_SIZE + DIB_HEADER_SIZE] = {0};
+    set_bytes(header, 0, 1, 'B');
+    set_bytes(header, 1, 1, 'M');
+    set_bytes(header, 2, 4, BMP_HEADER_SIZE + DIB_HEADER_SIZE + array_bytes);
+    set_bytes(header, 10, 4, BMP_HEADER_SIZE + DIB_HEADER_SIZE);
+    set_bytes(header, BMP_HEADER_SIZE + 0, 4, DIB_HEADER_SIZE);
+    set_bytes(header, BMP_HEADER_SIZE + 4, 4, width);
+    set_bytes(header, BMP_HEADER_SIZE + 8, 4, height);
+    set_bytes(header, BMP_HEADER_SIZE + 12, 2, 1);
+    set_bytes(header, BMP_HEADER_SIZE + 14, 2, 24);
+    set_bytes(header, BMP_HEADER_SIZE + 20, 4, array_bytes);
+    set_bytes(header, BMP_HEADER_SIZE + 24, 4, 2835);
+    set_bytes(header, BMP_HEADER_SIZE + 28, 4, 2835);
+    stream.write((char*)header, sizeof(header));
+}
+
+// Faster write_image() to any output stream: converts whole scanlines with the row kernels
+// before writing them. Produces the same bytes as write_image().
+bool write_image_fast(ostream& stream, const vector<vector<Pixel>>& image)
+{
+    if (image.empty() || image[0].empty())
+    {
+        return false;
+    }
+    int width = image[0].size();
+    int height = image.size();
+    write_bmp_header(stream, width, height);
+
+    // Padding bytes stay zero
+    vector<unsigned char> scanline(width * 3 + (4 - width * 3 % 4) % 4, 0);
+    const PixelKernels& kernels = pixel_kernels();
+    for (int row = height - 1; row >= 0; row--)
+    {
+        kernels.pack_bgr(image[row].data(), scanline.data(), width);
+        stream.write((char*)scanline.data(), scanline.size());
+    }
+    return stream.good();
+}
+
+#ifdef __unix__
+// Encode a BMP file with a thread per row band, each converting its rows a megabyte at a
+// time and writing them with pwrite() at their own offset. Produces the same bytes as
+// write_image().
+bool write_bmp_file_parallel(const string& filename, const vector<vector<Pixel>>& image)
+{
+    BmpInfo info;
+    info.start = 54;
+    info.width = image[0].size();
+    info.height = image.size();
+    info.bytes_per_pixel = 3;
+    info.row_bytes = info.width * 3 + (4 - info.width * 3 % 4) % 4;
+
+    int fd = open(filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (fd < 0)
+    {
+        return false;
+    }
+    ostringstream header;
+    write_bmp_header(header, info.width, info.height);
+    string header_bytes = header.str();
+
+    // Size the file first so the bands never extend it concurrently
+    bool ok = pwrite_all(fd, (const unsigned char*)header_bytes.data(), header_bytes.size(), 0) &&
+              ftruncate(fd, info.start + (long long)info.row_bytes * info.height) == 0;
+    vector<char> failed(worker_thread_count(), 0);
+    int chunk_rows = max(1, (1 << 20) / info.row_bytes);
+    if (ok)
+    {
+        const PixelKernels& kernels = pixel_kernels();
+        parallel_for_rows(info.height, [&](int band, int begin, int end)
+        {
+            // Padding bytes stay zero
+            vector<unsigned char> buffer((size_t)min(chunk_rows, end - begin) * info.row_bytes, 0);
+            for (int last = end; last > begin; last = last - chunk_rows)
+            {
+                int first = max(begin, last - chunk_rows);
+                for (int row = last - 1; row >= first; row--)
+                {
+                    kernels.pack_bgr(image[row].data(), &buffer[(size_t)(last - 1 - row) * info.row_bytes], info.width);
+                }
+                if (!pwrite_all(fd, buffer.data(), (size_t)(last - first) * info.row_bytes, bmp_pixel_offset(info, last - 1, 0)))
+                {
+                    failed[band] = 1;
+                    return;
+                }
+            }
+        }, io_rows_per_band(info));
+    }
+    ok = close(fd) == 0 && ok;
+    return ok && find(failed.begin(), failed.end(), 1) == failed.end();
+}
+#endif
+
+// Write an image file: QOI for a .qoi filename, otherwise BMP
+bool write_image_fast(const string& filename, const vector<vector<Pixel>>& image)
+{
+    if (image.empty() || image[0].empty())
+    {
+        return false;
+    }
+#ifdef __unix__
+    if (!is_qoi_filename(filename))
+    {
+        return write_bmp_file_parallel(filename, image);
+    }
+#endif
+    ofstream stream(filename, ios::binary);
+    if (!stream.is_open())
+    {
+        return false;
+    }
+    if (is_qoi_filename(filename))
+    {
+        return write_qoi(stream, image);
+    }
+    return write_image_fast(stream, image);
+}
+
+// Process 1
+vector<vector<Pixel>> process_1(const vector<vector<Pixel>>& image)
+{
+    return apply_pointwise(image, VignetteFilter{(int)image[0].size(), (int)image.size()});
+}
+
+// Process 1 in place, for callers that no longer need the original
+vector<vector<Pixel>> process_1(vector<vector<Pixel>>&& image)
+{
+    apply_pointwise_in_place(image, VignetteFilter{(int)image[0].size(), (int)image.size()});
+    return move(image);
+}
+
+// Process 2
+vector<vector<Pixel>> process_2(const vector<vector<Pixel>>& image, double scaling_factor)
+{
+    return apply_pointwise(image, ClarendonFilter{scaling_factor});
+}
+
+// Process 2 in place
+vector<vector<Pixel>> process_2(vector<vector<Pixel>>&& image, double scaling_factor)
+{
+    apply_pointwise_in_place(image, ClarendonFilter{scaling_factor});
+    return move(image);
+}
+
+// Process 3
+vector<vector<Pixel>> process_3(const vector<vector<Pixel>>& image)
+{
+    return apply_pointwise(image, GrayscaleFilter{});
+}
+
+// Process 3 in place
+vector<vector<Pixel>> process_3(vector<vector<Pixel>>&& image)
+{
+    apply_pointwise_in_place(image, GrayscaleFilter{});
+    return move(image);
+}
+
+// Process 4
+vector<vector<Pixel>> process_4(const vector<vector<Pixel>>& image)
+{
+    return apply_geometric(image, QuarterTurnFilter<1>{(int)image[0].size(), (int)image.size()});
+}
+
+// Process 5
+vector<vector<Pixel>> process_5(const vector<vector<Pixel>>& image, int number)
+{
+    int angle = number * 90;
+
+    if (angle % 90 != 0)
+    {
+        cout << "angle must be a multiple of 90 degrees." << endl;
+    }
+
+    // One pass for the whole rotation instead of one quarter turn at a time
+    int rotation = (angle % 360) / 90.0;
+    int width = image[0].size();
+    int height = image.size();
+    switch (rotation)
+    {
+        case 1: return apply_geometric(image, QuarterTurnFilter<1>{width, height});
+        case 2: return apply_geometric(image, QuarterTurnFilter<2>{width, height});
+        case 3: return apply_geometric(image, QuarterTurnFilter<3>{width, height});
+    }
+    return image;
+}
+
+// Process 5 without copying: half turns run in place and whole turns return the image as is
+vector<vector<Pixel>> process_5(vector<vector<Pixel>>&& image, int number)
+{
+    int rotation = (number * 90 % 360) / 90;
+    if (rotation == 1 || rotation == 3)
+    {
+        return process_5(image, number);
+    }
+    if (rotation == 2)
+    {
+        half_turn_in_place(image);
+    }
+    return move(image);
+}
+
+// Process 6
+vector<vector<Pixel>> process_6(const vector<vector<Pixel>>& image, int x_scale, int y_scale)
+{
+    return apply_geometric(image, EnlargeFilter{(int)image[0].size(), (int)image.size(), x_scale, y_scale});
+}
+
+// Process 7
+vector<vector<Pixel>> process_7(const vector<vector<Pixel>>& image)
+{
+    return apply_pointwise(image, HighContrastFilter{});
+}
+
+// Process 7 in place
+vector<vector<Pixel>> process_7(vector<vector<Pixel>>&& image)
+{
+    apply_pointwise_in_place(image, HighContrastFilter{});
+    return move(image);
+}
+
+// Process 8
+vector<vector<Pixel>> process_8(const vector<vector<Pixel>>& image, double scaling_factor)
+{
+    return apply_pointwise(image, LightenFilter{scaling_factor});
+}
+
+// Process 8 in place
+vector<vector<Pixel>> process_8(vector<vector<Pixel>>&& image, double scaling_factor)
+{
+    apply_pointwise_in_place(image, LightenFilter{scaling_factor});
+    return move(image);
+}
+
+// Process 9
+vector<vector<Pixel>> process_9(const vector<vector<Pixel>>& image, double scaling_factor)
+{
+    return apply_pointwise(image, DarkenFilter{scaling_factor});
+}
+
+// Process 9 in place
+vector<vector<Pixel>> process_9(vector<vector<Pixel>>&& image, double scaling_factor)
+{
+    apply_pointwise_in_place(image, DarkenFilter{scaling_factor});
+    return move(image);
+}
+
+// Process 10
+vector<vector<Pixel>> process_10(const vector<vector<Pixel>>& image)
+{
+    return apply_pointwise(image, PrimaryColorsFilter{});
+}
+
+// Process 10 in place
+vector<vector<Pixel>> process_10(vector<vector<Pixel>>&& image)
+{
+    apply_pointwise_in_place(image, PrimaryColorsFilter{});
+    return move(image);
+}
+
+// A block of the image with a border of halo pixels on every side. Pixels outside the
+// image repeat the nearest edge pixel, so neighborhood kernels never check bounds.
+struct Tile
+{
+    int top = 0;
+    int left = 0;
+    int height = 0;
+    int width = 0;
+    int halo = 0;
+    int stride = 0;             // width + 2 * halo
+    vector<Pixel> pixels;       // (height + 2 * halo) rows of stride pixels
+
+    // Pixel at a position relative to the tile's top-left corner, from -halo to size + halo - 1
+    const Pixel& at(int row, int col) const
+    {
+        return pixels[(row + halo) * stride + col + halo];
+    }
+};
+
+// Run a neighborhood kernel over the image one tile at a time, spreading the tiles across
+// cores. The kernel reads a tile with its halo and writes tile.height rows of tile.width
+// result pixels to out. Every output pixel depends only on its neighborhood, so results do
+// not depend on the tile size or thread count.
+vector<vector<Pixel>> apply_tiled(const vector<vector<Pixel>>& image, int halo,
+                                  const function<void(const Tile& tile, vector<Pixel>& out)>& kernel,
+                                  int tile_size = 256)
+{
+    int height = image.size();
+    int width = image[0].size();
+
+    // Keep the halo a small fraction of each tile even for wide kernels
+    tile_size = max(tile_size, 4 * halo);
+    int tile_rows = (height + tile_size - 1) / tile_size;
+    int tile_cols = (width + tile_size - 1) / tile_size;
+    vector<vector<Pixel>> new_image = make_image(height, width);
+
+    parallel_for_rows(tile_rows * tile_cols, [&](int, int begin, int end)
+    {
+        // Buffers are reused for every tile of the band
+        Tile tile;
+        vector<Pixel> out;
+        for (int index = begin; index < end; index++)
+        {
+            tile.top = index / tile_cols * tile_size;
+            tile.left = index % tile_cols * tile_size;
+            tile.height = min(tile_size, height - tile.top);
+            tile.width = min(tile_size, width - tile.left);
+            tile.halo = halo;
+            tile.stride = tile.width + 2 * halo;
+            tile.pixels.resize((tile.height + 2 * halo) * tile.stride);
+
+            for (int row = -halo; row < tile.height + halo; row++)
+            {
+                const vector<Pixel>& source = image[min(max(tile.top + row, 0), height - 1)];
+                Pixel* destination = &tile.pixels[(row + halo) * tile.stride];
+                for (int col = -halo; col < tile.width + halo; col++)
+                {
+                    destination[col + halo] = source[min(max(tile.left + col, 0), width - 1)];
+                }
+            }
+
+            out.resize(tile.height * tile.width);
+            kernel(tile, out);
+
+            for (int row = 0; row < tile.height; row++)
+            {
+                copy(out.begin() + row * tile.width, out.begin() + (row + 1) * tile.width,
+                     new_image[tile.top + row].begin() + tile.left);
+            }
+        }
+    }, 1);
+
+    return new_image;
+}
+
+// One box blur pass as a valid convolution: src is src_height x src_width pixels and dst gets
+// (src_height - 2 * radius) x (src_width - 2 * radius). Horizontal and vertical running sums
+// make the cost per pixel independent of the radius.
+void box_blur_pass(const vector<Pixel>& src, int src_height, int src_width, int radius,
+                   vector<Pixel>& dst, vector<Pixel>& scratch)
+{
+    int size = 2 * radius + 1;
+    int area = size * size;
+    int out_height = src_height - 2 * radius;
+    int out_width = src_width - 2 * radius;
+
+    // Horizontal window sums for every source row
+    scratch.resize(src_height * out_width);
+    for (int row = 0; row < src_height; row++)
+    {
+        const Pixel* in = &src[row * src_width];
+        Pixel* sums = &scratch[row * out_width];
+        int red = 0;
+        int green = 0;
+        int blue = 0;
+        for (int i = 0; i < size; i++)
+        {
+            red = red + in[i].red;
+            green = green + in[i].green;
+            blue = blue + in[i].blue;
+        }
+        for (int col = 0; col < out_width; col++)
+        {
+            sums[col] = {red, green, blue};
+            if (col + 1 < out_width)
+            {
+                red = red + in[col + size].red - in[col].red;
+                green = green + in[col + size].green - in[col].green;
+                blue = blue + in[col + size].blue - in[col].blue;
+            }
+        }
+    }
+
+    // Vertical window sums, advanced a whole row at a time to stay cache friendly
+    vector<Pixel> column(out_width, {0, 0, 0});
+    for (int i = 0; i < size; i++)
+    {
+        const Pixel* sums = &scratch[i * out_width];
+        for (int col = 0; col < out_width; col++)
+        {
+            column[col].red = column[col].red + sums[col].red;
+            column[col].green = column[col].green + sums[col].green;
+            column[col].blue = column[col].blue + sums[col].blue;
+        }
+    }
+
+    dst.resize(out_height * out_width);
+    for (int row = 0; row < out_height; row++)
+    {
+        Pixel* out = &dst[row * out_width];
+        for (int col = 0; col < out_width; col++)
+        {
+            out[col].red = (column[col].red + area / 2) / area;
+            out[col].green = (column[col].green + area / 2) / area;
+            out[col].blue = (column[col].blue + area / 2) / area;
+        }
+        if (row + 1 < out_height)
+        {
+            const Pixel* entering = &scratch[(row + size) * out_width];
+            const Pixel* leaving = &scratch[row * out_width];
+            for (int col = 0; col < out_width; col++)
+            {
+                column[col].red = column[col].red + entering[col].red - leaving[col].red;
+                column[col].green = column[col].green + entering[col].green - leaving[col].green;
+                column[col].blue = column[col].blue + entering[col].blue - leaving[col].blue;
+            }
+        }
+    }
+}
+
+// Radii of three box blurs whose combination approximates a Gaussian blur of the given sigma
+vector<int> gaussian_box_radii(double sigma)
+{
+    const int PASSES = 3;
+    int lower = sqrt(12.0 * sigma * sigma / PASSES + 1.0);
+    if (lower % 2 == 0)
+    {
+        lower--;
+    }
+    int upper = lower + 2;
+    double ideal = (12.0 * sigma * sigma - PASSES * lower * lower - 4.0 * PASSES * lower - 3.0 * PASSES) / (-4.0 * lower - 4.0);
+    int lower_count = round(ideal);
+
+    vector<int> radii;
+    for (int i = 0; i < PASSES; i++)
+    {
+        radii.push_back(((i < lower_count ? lower : upper) - 1) / 2);
+    }
+    return radii;
+}
+
+// Run box blur passes over a tile and its halo. The sum of the radii must equal the halo.
+void box_blur_tile(const Tile& tile, const vector<int>& radii, vector<Pixel>& out, vector<Pixel>& scratch)
+{
+    vector<Pixel> current = tile.pixels;
+    int rows = tile.height + 2 * tile.halo;
+    int cols = tile.stride;
+    for (int radius : radii)
+    {
+        box_blur_pass(current, rows, cols, radius, out, scratch);
+        rows = rows - 2 * radius;
+        cols = cols - 2 * radius;
+        current.swap(out);
+    }
+    out.swap(current);
+}
+
+// Process 11
+vector<vector<Pixel>> process_11(const vector<vector<Pixel>>& image, int radius)
+{
+    return apply_tiled(image, radius, [radius](const Tile& tile, vector<Pixel>& out)
+    {
+        vector<Pixel> scratch;
+        box_blur_tile(tile, {radius}, out, scratch);
+    });
+}
+
+// Process 12
+vector<vector<Pixel>> process_12(const vector<vector<Pixel>>& image, double sigma)
+{
+    vector<int> radii = gaussian_box_radii(sigma);
+    int halo = radii[0] + radii[1] + radii[2];
+
+    return apply_tiled(image, halo, [&radii](const Tile& tile, vector<Pixel>& out)
+    {
+        vector<Pixel> scratch;
+        box_blur_tile(tile, radii, out, scratch);
+    });
+}
+
+// Process 13
+vector<vector<Pixel>> process_13(const vector<vector<Pixel>>& image, double sigma, double amount)
+{
+    vector<int> radii = gaussian_box_radii(sigma);
+    int halo = radii[0] + radii[1] + radii[2];
+
+    // Unsharp mask: push every pixel away from its blurred neighborhood
+    return apply_tiled(image, halo, [&radii, amount](const Tile& tile, vector<Pixel>& out)
+    {
+        vector<Pixel> scratch;
+        box_blur_tile(tile, radii, out, scratch);
+        for (int row = 0; row < tile.height; row++)
+        {
+            for (int col = 0; col < tile.width; col++)
+            {
+                const Pixel& original = tile.at(row, col);
+                Pixel& result = out[row * tile.width + col];
+                result.red = min(255, max(0, (int)lround(original.red + amount * (original.red - result.red))));
+                result.green = min(255, max(0, (int)lround(original.green + amount * (original.green - result.green))));
+                result.blue = min(255, max(0, (int)lround(original.blue + amount * (original.blue - result.blue))));
+            }
+        }
+    });
+}
+
+// Histograms and simple statistics of an image
+struct ImageStats
+{
+    long long pixels = 0;
+    long long red[256] = {0};
+    long long green[256] = {0};
+    long long blue[256] = {0};
+    long long luminance[256] = {0};     // Rec. 601 luma
+};
+
+// Histogram index of a channel value (processed images stay in range, this guards the rest)
+inline int histogram_bin(int value)
+{
+    return min(255, max(0, value));
+}
+
+// Build all histograms in one pass. Each thread fills its own partial histograms,
+// which are merged at the end so no counter is ever shared between threads.
+ImageStats compute_image_stats(const vector<vector<Pixel>>& image)
+{
+    int height = image.size();
+    int width = image[0].size();
+    vector<ImageStats> partial(worker_thread_count());
+
+    int bands = parallel_for_rows(height, [&](int band, int begin, int end)
+    {
+        ImageStats& stats = partial[band];
+        for (int row = begin; row < end; row++)
+        {
+            for (int col = 0; col < width; col++)
+            {
+                int red = histogram_bin(image[row][col].red);
+                int green = histogram_bin(image[row][col].green);
+                int blue = histogram_bin(image[row][col].blue);
+                stats.red[red]++;
+                stats.green[green]++;
+                stats.blue[blue]++;
+                stats.luminance[(77 * red + 150 * green + 29 * blue + 128) >> 8]++;
+            }
+        }
+        stats.pixels = (long long)(end - begin) * width;
+    });
+
+    ImageStats total;
+    for (int band = 0; band < bands; band++)
+    {
+        total.pixels = total.pixels + partial[band].pixels;
+        for (int i = 0; i < 256; i++)
+        {
+            total.red[i] = total.red[i] + partial[band].red[i];
+            total.green[i] = total.green[i] + partial[band].green[i];
+            total.blue[i] = total.blue[i] + partial[band].blue[i];
+            total.luminance[i] = total.luminance[i] + partial[band].luminance[i];
+        }
+    }
+    return total;
+}
+
+// Smallest and largest values present in a histogram
+void histogram_range(const long long histogram[256], int& low, int& high)
+{
+    low = 0;
+    while (low < 255 && histogram[low] == 0) low++;
+    high = 255;
+    while (high > 0 && histogram[high] == 0) high--;
+}
+
+// Mean value of a histogram
+double histogram_mean(const long long histogram[256], long long pixels)
+{
+    double sum = 0.0;
+    for (int i = 0; i < 256; i++)
+    {
+        sum = sum + (double)i * histogram[i];
+    }
+    return pixels > 0 ? sum / pixels : 0.0;
+}
+
+// Print min, max and mean of every channel and the luminance
+void print_image_stats(const ImageStats& stats)
+{
+    const long long* histograms[4] = {stats.red, stats.green, stats.blue, stats.luminance};
+    string names[4] = {"red", "green", "blue", "luminance"};
+    cout << stats.pixels << " pixels" << endl;
+    for (int i = 0; i < 4; i++)
+    {
+        int low;
+        int high;
+        histogram_range(histograms[i], low, high);
+        cout << "  " << left << setw(10) << names[i] << right << " min " << setw(3) << low << "  max " << setw(3) << high
+             << "  mean " << fixed << setprecision(2) << histogram_mean(histograms[i], stats.pixels) << defaultfloat << endl;
+    }
+}
+
+// Table stretching a channel so the darkest and brightest values (ignoring the most extreme
+// clip fraction of pixels at each end) span the full 0-255 range
+void auto_levels_table(const long long histogram[256], long long pixels, double clip, int table[256])
+{
+    long long ignored = pixels * clip;
+    int low = 0;
+    long long count = histogram[0];
+    while (low < 255 && count <= ignored)
+    {
+        low++;
+        count = count + histogram[low];
+    }
+    int high = 255;
+    count = histogram[255];
+    while (high > 0 && count <= ignored)
+    {
+        high--;
+        count = count + histogram[high];
+    }
+
+    for (int i = 0; i < 256; i++)
+    {
+        table[i] = high > low ? min(255, max(0, (int)lround((i - low) * 255.0 / (high - low)))) : i;
+    }
+}
+
+// Table spreading a channel's values evenly over 0-255 by their cumulative histogram
+void equalize_table(const long long histogram[256], long long pixels, int table[256])
+{
+    int last = 255;
+    while (last > 0 && histogram[last] == 0) last--;
+    long long step = (pixels - histogram[last]) / 255;
+
+    long long running = step / 2;
+    for (int i = 0; i < 256; i++)
+    {
+        table[i] = step == 0 ? i : min(255LL, running / step);
+        running = running + histogram[i];
+    }
+}
+
+// Channel tables of process 14 (auto levels) or 15 (equalize) for an image's statistics
+void histogram_process_tables(int process, const ImageStats& stats, int tables[3][256])
+{
+    const double CLIP = 0.005;
+    const long long* histograms[3] = {stats.red, stats.green, stats.blue};
+    for (int channel = 0; channel < 3; channel++)
+    {
+        if (process == 14)
+        {
+            auto_levels_table(histograms[channel], stats.pixels, CLIP, tables[channel]);
+        }
+        else
+        {
+            equalize_table(histograms[channel], stats.pixels, tables[channel]);
+        }
+    }
+}
+
+// Process 14
+vector<vector<Pixel>> process_14(const vector<vector<Pixel>>& image)
+{
+    int tables[3][256];
+    histogram_process_tables(14, compute_image_stats(image), tables);
+    return apply_pointwise(image, ChannelTablesFilter{tables[0], tables[1], tables[2]});
+}
+
+// Process 14 in place
+vector<vector<Pixel>> process_14(vector<vector<Pixel>>&& image)
+{
+    int tables[3][256];
+    histogram_process_tables(14, compute_image_stats(image), tables);
+    apply_pointwise_in_place(image, ChannelTablesFilter{tables[0], tables[1], tables[2]});
+    return move(image);
+}
+
+// Process 15
+vector<vector<Pixel>> process_15(const vector<vector<Pixel>>& image)
+{
+    int tables[3][256];
+    histogram_process_tables(15, compute_image_stats(image), tables);
+    return apply_pointwise(image, ChannelTablesFilter{tables[0], tables[1], tables[2]});
+}
+
+// Process 15 in place
+vector<vector<Pixel>> process_15(vector<vector<Pixel>>&& image)
+{
+    int tables[3][256];
+    histogram_process_tables(15, compute_image_stats(image), tables);
+    apply_pointwise_in_place(image, ChannelTablesFilter{tables[0], tables[1], tables[2]});
+    return move(image);
+}
+
+// How resampling computes a pixel between source pixels
+enum Interpolation
+{
+    NEAREST_NEIGHBOR,
+    BILINEAR,
+    BICUBIC
+};
+
+// Read nearest, bilinear or bicubic. Returns false for anything else.
+bool parse_interpolation(const string& text, Interpolation& interpolation)
+{
+    const string names[3] = {"nearest", "bilinear", "bicubic"};
+    for (int i = 0; i < 3; i++)
+    {
+        if (text == names[i])
+        {
+            interpolation = (Interpolation)i;
+            return true;
+        }
+    }
+    return false;
+}
+
+// Read a target size "WIDTHxHEIGHT", where either side may be 0 to follow the aspect ratio
+bool parse_size(const string& text, int& width, int& height)
+{
+    istringstream in(text);
+    int parsed_width;
+    int parsed_height;
+    char separator = 0;
+    if (!(in >> parsed_width >> separator >> parsed_height))
+    {
+        return false;
+    }
+    in >> ws;
+    if (!in.eof() || separator != 'x' || parsed_width < 0 || parsed_height < 0 || parsed_width + parsed_height == 0)
+    {
+        return false;
+    }
+    width = parsed_width;
+    height = parsed_height;
+    return true;
+}
+
+// Read a color written as "red,green,blue", each 0-255
+bool parse_color(const string& text, Pixel& color)
+{
+    istringstream in(text);
+    Pixel parsed;
+    char separators[2] = {0};
+    if (!(in >> parsed.red >> separators[0] >> parsed.green >> separators[1] >> parsed.blue))
+    {
+        return false;
+    }
+    in >> ws;
+    if (!in.eof() || separators[0] != ',' || separators[1] != ',' || parsed.red < 0 || parsed.red > 255 ||
+        parsed.green < 0 || parsed.green > 255 || parsed.blue < 0 || parsed.blue > 255)
+    {
+        return false;
+    }
+    color = parsed;
+    return true;
+}
+
+// Size of a resample's result: the target size, with a missing side following the aspect
+// ratio, or without a target the input size times the scale
+void resample_size(double scale, int target_width, int target_height, int width, int height, int& out_width, int& out_height)
+{
+    if (target_width > 0 && target_height > 0)
+    {
+        out_width = target_width;
+        out_height = target_height;
+    }
+    else if (target_width > 0)
+    {
+        out_width = target_width;
+        out_height = max(1, (int)lround((double)height * target_width / width));
+    }
+    else if (target_height > 0)
+    {
+        out_width = max(1, (int)lround((double)width * target_height / height));
+        out_height = target_height;
+    }
+    else
+    {
+        out_width = max(1, (int)lround(width * scale));
+        out_height = max(1, (int)lround(height * scale));
+    }
+}
+
+// Reach of the resampling filter in source pixels on either side of an output pixel's center.
+// When shrinking, the filter widens with the scale so every source pixel contributes.
+double resample_support(int in_size, int out_size, Interpolation interpolation)
+{
+    double radius = interpolation == BICUBIC ? 2.0 : 1.0;
+    return radius * max(1.0, (double)in_size / out_size);
+}
+
+// Source pixels [first, last) along one axis that output position reads
+void resample_window(int in_size, int out_size, Interpolation interpolation, int position, int& first, int& last)
+{
+    double center = (position + 0.5) * in_size / out_size;
+    if (interpolation == NEAREST_NEIGHBOR)
+    {
+        first = min(in_size - 1, (int)center);
+        last = first + 1;
+        return;
+    }
+    double support = resample_support(in_size, out_size, interpolation);
+    first = max(0, (int)floor(center - support + 0.5));
+    last = min(in_size, (int)floor(center + support + 0.5));
+}
+
+// Weight of a source pixel x pixels from the center: a triangle for bilinear, the Keys cubic
+// with a = -0.5 (Catmull-Rom) for bicubic
+double resample_kernel(double x, Interpolation interpolation)
+{
+    x = fabs(x);
+    if (interpolation == BILINEAR)
+    {
+        return x < 1.0 ? 1.0 - x : 0.0;
+    }
+    const double A = -0.5;
+    if (x < 1.0)
+    {
+        return ((A + 2.0) * x - (A + 3.0)) * x * x + 1.0;
+    }
+    if (x < 2.0)
+    {
+        return (((x - 5.0) * x + 8.0) * x - 4.0) * A;
+    }
+    return 0.0;
+}
+
+// Source pixels and weights of output positions [begin, end) along one axis, computed once
+// and shared by every row or column. Every position has the same number of taps; taps past
+// the filter's reach repeat its first source pixel with weight 0.
+struct ResampleTaps
+{
+    int taps = 0;
+    vector<int> index;
+    vector<float> weights;
+};
+
+ResampleTaps resample_taps(int in_size, int out_size, Interpolation interpolation, int begin, int end)
+{
+    ResampleTaps result;
+    double scale = (double)in_size / out_size;
+    double filter_scale = max(1.0, scale);
+    result.taps = 2 * (int)ceil(resample_support(in_size, out_size, interpolation)) + 1;
+    result.index.resize((size_t)(end - begin) * result.taps);
+    result.weights.resize(result.index.size());
+
+    vector<double> weights(result.taps);
+    for (int position = begin; position < end; position++)
+    {
+        int first;
+        int last;
+        resample_window(in_size, out_size, interpolation, position, first, last);
+        double center = (position + 0.5) * scale;
+        double total = 0.0;
+        for (int tap = 0; tap < result.taps; tap++)
+        {
+            int source = first + tap;
+            weights[tap] = source < last ? resample_kernel((source + 0.5 - center) / filter_scale, interpolation) : 0.0;
+            total = total + weights[tap];
+        }
+        size_t offset = (size_t)(position - begin) * result.taps;
+        for (int tap = 0; tap < result.taps; tap++)
+        {
+            result.index[offset + tap] = first + tap < last ? first + tap : first;
+            result.weights[offset + tap] = total != 0.0 ? weights[tap] / total : 0.0;
+        }
+    }
+    return result;
+}
+
+// Output rows [top, bottom) of resampling a width x height image to out_width x out_height.
+// rows holds input rows from first_row on, at least the ones those output rows read, so a
+// strip of the output can be made from a strip of the input. Rows are resampled horizontally
+// into floats first, then vertically, each pass with taps computed once per axis.
+vector<vector<Pixel>> resample_rows(const vector<vector<Pixel>>& rows, int first_row, int height, int out_width,
+                                    int out_height, int top, int bottom, Interpolation interpolation)
+{
+    int width = rows[0].size();
+    vector<vector<Pixel>> result = make_image(bottom - top, out_width);
+    int first;
+    int last;
+    int unused;
+    resample_window(height, out_height, interpolation, top, first, unused);
+    resample_window(height, out_height, interpolation, bottom - 1, unused, last);
+
+    if (interpolation == NEAREST_NEIGHBOR)
+    {
+        vector<int> columns(out_width);
+        for (int col = 0; col < out_width; col++)
+        {
+            resample_window(width, out_width, interpolation, col, columns[col], unused);
+        }
+        parallel_for_rows(bottom - top, [&](int, int begin, int end)
+        {
+            for (int row = begin; row < end; row++)
+            {
+                int source_row;
+                resample_window(height, out_height, interpolation, top + row, source_row, unused);
+                const Pixel* src = rows[source_row - first_row].data();
+                Pixel* dst = result[row].data();
+                for (int col = 0; col < out_width; col++)
+                {
+                    dst[col] = src[columns[col]];
+                }
+            }
+        });
+        return result;
+    }
+
+    ResampleTaps columns = resample_taps(width, out_width, interpolation, 0, out_width);
+    ResampleTaps lines = resample_taps(height, out_height, interpolation, top, bottom);
+    const PixelKernels& kernels = pixel_kernels();
+
+    vector<vector<float>> horizontal(last - first, vector<float>(3 * out_width));
+    parallel_for_rows(last - first, [&](int, int begin, int end)
+    {
+        for (int row = begin; row < end; row++)
+        {
+            kernels.resample_row(rows[first + row - first_row].data(), columns.index.data(), columns.weights.data(),
+                                 columns.taps, horizontal[row].data(), out_width);
+        }
+    });
+
+    parallel_for_rows(bottom - top, [&](int, int begin, int end)
+    {
+        vector<const float*> sources(lines.taps);
+        vector<float> sums(3 * out_width);
+        for (int row = begin; row < end; row++)
+        {
+            size_t offset = (size_t)row * lines.taps;
+            for (int tap = 0; tap < lines.taps; tap++)
+            {
+                sources[tap] = horizontal[lines.index[offset + tap] - first].data();
+            }
+            kernels.resample_column(sources.data(), &lines.weights[offset], lines.taps, sums.data(), result[row].data(), out_width);
+        }
+    });
+    return result;
+}
+
+// Process 16
+vector<vector<Pixel>> process_16(const vector<vector<Pixel>>& image, double scale, int target_width, int target_height,
+                                 Interpolation interpolation)
+{
+    int height = image.size();
+    int width = image[0].size();
+    int out_width;
+    int out_height;
+    resample_size(scale, target_width, target_height, width, height, out_width, out_height);
+    return resample_rows(image, 0, height, out_width, out_height, 0, out_height, interpolation);
+}
+
+// Rotation by any angle. Output pixels are mapped back to the source with coordinates kept
+// in 1/65536 pixel steps: each row of a tile starts from the exact position and steps by a
+// fixed increment per pixel, so there is no trigonometry per pixel and the result does not
+// depend on how rows are split into bands or strips.
+
+const int ROTATE_FRACTION_BITS = 16;
+
+// Size of the smallest image holding a width x height image rotated by angle degrees
+void rotate_size(double angle, int width, int height, int& out_width, int& out_height)
+{
+    double radians = angle * M_PI / 180.0;
+    double cos_angle = fabs(cos(radians));
+    double sin_angle = fabs(sin(radians));
+    out_width = max(1, (int)ceil(width * cos_angle + height * sin_angle - 1e-6));
+    out_height = max(1, (int)ceil(width * sin_angle + height * cos_angle - 1e-6));
+}
+
+// Inverse mapping of a clockwise rotation about the image centers: the source position, in
+// pixel indices, of an output pixel. One output column to the right moves it by
+// (cos_angle, -sin_angle).
+struct RotateMapping
+{
+    double cos_angle;
+    double sin_angle;
+    double source_x;    // Source position of output pixel (0, 0)
+    double source_y;
+
+    RotateMapping(double angle, int width, int height, int out_width, int out_height)
+    {
+        double radians = angle * M_PI / 180.0;
+        cos_angle = cos(radians);
+        sin_angle = sin(radians);
+        double dx = 0.5 - out_width / 2.0;
+        double dy = 0.5 - out_height / 2.0;
+        source_x = cos_angle * dx + sin_angle * dy + width / 2.0 - 0.5;
+        source_y = -sin_angle * dx + cos_angle * dy + height / 2.0 - 0.5;
+    }
+
+    double x(int row, int col) const
+    {
+        return source_x + cos_angle * col + sin_angle * row;
+    }
+
+    double y(int row, int col) const
+    {
+        return source_y - sin_angle * col + cos_angle * row;
+    }
+};
+
+// A position or step in 1/65536 pixel units
+long long rotate_fixed(double value)
+{
+    return llround(value * (1 << ROTATE_FRACTION_BITS));
+}
+
+// Source rows [first, last) read by output rows [top, bottom)
+void rotate_source_rows(double angle, int width, int height, int out_width, int out_height, int top, int bottom,
+                        int& first, int& last)
+{
+    RotateMapping mapping(angle, width, height, out_width, out_height);
+    double corners[4] = {mapping.y(top, 0), mapping.y(top, out_width - 1), mapping.y(bottom - 1, 0),
+                         mapping.y(bottom - 1, out_width - 1)};
+    double lowest = *min_element(corners, corners + 4);
+    double highest = *max_element(corners, corners + 4);
+    first = min(height - 1, max(0, (int)floor(lowest) - 1));
+    last = max(first + 1, min(height, (int)floor(highest) + 3));
+}
+
+// Output rows [top, bottom) of rotating a height-row image clockwise by angle degrees into an
+// out_width x out_height image. rows holds input rows from first_row on, at least the ones
+// rotate_source_rows() names. Pixels that fall outside the source take the background; with
+// bilinear sampling the edges blend into it. The output is filled in square tiles so the
+// source pixels a tile reads stay in cache whatever the angle.
+vector<vector<Pixel>> rotate_rows(const vector<vector<Pixel>>& rows, int first_row, int height, int out_width,
+                                  int out_height, int top, int bottom, double angle, Interpolation interpolation,
+                                  Pixel background)
+{
+    int width = rows[0].size();
+    vector<vector<Pixel>> result = make_image(bottom - top, out_width);
+    RotateMapping mapping(angle, width, height, out_width, out_height);
+    long long step_x = rotate_fixed(mapping.cos_angle);
+    long long step_y = rotate_fixed(-mapping.sin_angle);
+    const long long ONE = 1LL << ROTATE_FRACTION_BITS;
+    const int BLOCK = 64;
+
+    parallel_for_rows(bottom - top, [&](int, int begin, int end)
+    {
+        for (int row_block = begin; row_block < end; row_block += BLOCK)
+        {
+            for (int col_block = 0; col_block < out_width; col_block += BLOCK)
+            {
+                int row_end = min(row_block + BLOCK, end);
+                int col_end = min(col_block + BLOCK, out_width);
+                for (int row = row_block; row < row_end; row++)
+                {
+                    long long x = rotate_fixed(mapping.x(top + row, col_block));
+                    long long y = rotate_fixed(mapping.y(top + row, col_block));
+                    Pixel* dst = result[row].data();
+                    if (interpolation == NEAREST_NEIGHBOR)
+                    {
+                        for (int col = col_block; col < col_end; col++, x += step_x, y += step_y)
+                        {
+                            int source_col = (int)((x + ONE / 2) >> ROTATE_FRACTION_BITS);
+                            int source_row = (int)((y + ONE / 2) >> ROTATE_FRACTION_BITS);
+                            bool inside = (unsigned)source_col < (unsigned)width && (unsigned)source_row < (unsigned)height;
+                            dst[col] = inside ? rows[source_row - first_row][source_col] : background;
+                        }
+                        continue;
+                    }
+                    for (int col = col_block; col < col_end; col++, x += step_x, y += step_y)
+                    {
+                        int left = (int)(x >> ROTATE_FRACTION_BITS);
+                        int upper = (int)(y >> ROTATE_FRACTION_BITS);
+                        int fx = (int)(x >> (ROTATE_FRACTION_BITS - 8)) & 255;
+                        int fy = (int)(y >> (ROTATE_FRACTION_BITS - 8)) & 255;
+                        const Pixel* p00;
+                        const Pixel* p01;
+                        const Pixel* p10;
+                        const Pixel* p11;
+                        if (left >= 0 && left < width - 1 && upper >= 0 && upper < height - 1)
+                        {
+                            p00 = &rows[upper - first_row][left];
+                            p01 = p00 + 1;
+                            p10 = &rows[upper + 1 - first_row][left];
+                            p11 = p10 + 1;
+                        }
+                        else if (left < -1 || left >= width || upper < -1 || upper >= height)
+                        {
+                            dst[col] = background;
+                            continue;
+                        }
+                        else
+                        {
+                            // On the edge: taps outside the source read the background
+                            auto tap = [&](int r, int c)
+                            {
+                                bool inside = (unsigned)c < (unsigned)width && (unsigned)r < (unsigned)height;
+                                return inside ? &rows[r - first_row][c] : &background;
+                            };
+                            p00 = tap(upper, left);
+                            p01 = tap(upper, left + 1);
+                            p10 = tap(upper + 1, left);
+                            p11 = tap(upper + 1, left + 1);
+                        }
+                        int red_top = p00->red * (256 - fx) + p01->red * fx;
+                        int red_bottom = p10->red * (256 - fx) + p11->red * fx;
+                        int green_top = p00->green * (256 - fx) + p01->green * fx;
+                        int green_bottom = p10->green * (256 - fx) + p11->green * fx;
+                        int blue_top = p00->blue * (256 - fx) + p01->blue * fx;
+                        int blue_bottom = p10->blue * (256 - fx) + p11->blue * fx;
+                        dst[col].red = (red_top * (256 - fy) + red_bottom * fy + 32768) >> 16;
+                        dst[col].green = (green_top * (256 - fy) + green_bottom * fy + 32768) >> 16;
+                        dst[col].blue = (blue_top * (256 - fy) + blue_bottom * fy + 32768) >> 16;
+                    }
+                }
+            }
+        }
+    }, BLOCK);
+    return result;
+}
+
+// Whether angle is a whole number of quarter turns, and how many (0-3) clockwise
+bool right_angle_turns(double angle, int& number)
+{
+    double turns = angle / 90.0;
+    if (turns != floor(turns))
+    {
+        return false;
+    }
+    number = ((int)turns % 4 + 4) % 4;
+    return true;
+}
+
+// Process 17
+vector<vector<Pixel>> process_17(const vector<vector<Pixel>>& image, double angle, Interpolation interpolation,
+                                 Pixel background)
+{
+    int height = image.size();
+    int width = image[0].size();
+    int number;
+    if (right_angle_turns(angle, number))
+    {
+        // Right angles come out the same either way; the quarter turn filters are faster
+        return number == 0 ? image : process_5(image, number);
+    }
+    int out_width;
+    int out_height;
+    rotate_size(angle, width, height, out_width, out_height);
+    return rotate_rows(image, 0, height, out_width, out_height, 0, out_height, angle, interpolation, background);
+}
+
+// Parameters for one run of a process function
+struct ProcessRequest
+{
+    int process = 0;
+    double scaling_factor = 0.0;    // Processes 2, 8 and 9
+    int number = 0;                 // Process 5
+    int x_scale = 1;                // Process 6
+    int y_scale = 1;                // Process 6
+    int radius = 1;                 // Process 11
+    double sigma = 1.0;             // Processes 12 and 13
+    double amount = 1.0;            // Process 13
+    double scale = 1.0;             // Process 16, without a target size
+    int target_width = 0;           // Process 16, 0 to follow the aspect ratio or the scale
+    int target_height = 0;          // Process 16, 0 to follow the aspect ratio or the scale
+    Interpolation interpolation = BILINEAR;     // Processes 16 and 17
+    double angle = 0.0;             // Process 17, degrees clockwise
+    Pixel background = {0, 0, 0};   // Process 17, fill outside the rotated image
+    Region crop;                    // Only this part of the input is processed and saved
+    Region roi;                     // Only this part of the (cropped) image is changed
+};
+
+// Whether a process leaves the image dimensions unchanged
+bool process_keeps_size(const ProcessRequest& request)
+{
+    return request.process != 4 && request.process != 6 && request.process != 16 && request.process != 17 &&
+           !(request.process == 5 && request.number % 2 == 1);
+}
+
+vector<vector<Pixel>> apply_process(const vector<vector<Pixel>>& image, const ProcessRequest& request);
+vector<vector<Pixel>> apply_process(vector<vector<Pixel>>&& image, const ProcessRequest& request);
+
+// Run the process inside the region of interest of an image the caller no longer needs.
+// Pixels outside the region pass through unchanged; the process sees the region as an
+// image of its own.
+vector<vector<Pixel>> apply_process_in_roi(vector<vector<Pixel>>&& image, const ProcessRequest& request)
+{
+    ProcessRequest inner = request;
+    inner.crop = Region();
+    inner.roi = Region();
+    if (request.roi.empty())
+    {
+        return apply_process(move(image), inner);
+    }
+
+    Region roi = request.roi;
+    vector<vector<Pixel>> inside = crop_image(image, roi);
+    if (inside.empty())
+    {
+        return move(image);
+    }
+    inside = apply_process(move(inside), inner);
+    for (int row = 0; row < roi.height; row++)
+    {
+        copy(inside[row].begin(), inside[row].end(), image[roi.y + row].begin() + roi.x);
+    }
+    return move(image);
+}
+
+// Crop the image, then run the process inside the region of interest only
+vector<vector<Pixel>> apply_process_in_region(const vector<vector<Pixel>>& image, const ProcessRequest& request)
+{
+    if (request.crop.empty())
+    {
+        return apply_process_in_roi(vector<vector<Pixel>>(image), request);
+    }
+    Region crop = request.crop;
+    vector<vector<Pixel>> cropped = crop_image(image, crop);
+    if (cropped.empty())
+    {
+        return {};
+    }
+    return apply_process_in_roi(move(cropped), request);
+}
+
+// Run the process function selected by the request
+vector<vector<Pixel>> apply_process(const vector<vector<Pixel>>& image, const ProcessRequest& request)
+{
+    if (!request.crop.empty() || !request.roi.empty())
+    {
+        return apply_process_in_region(image, request);
+    }
+
+    switch (request.process)
+    {
+        case 1: return process_1(image);
+        case 2: return process_2(image, request.scaling_factor);
+        case 3: return process_3(image);
+        case 4: return process_4(image);
+        case 5: return process_5(image, request.number);
+        case 6: return process_6(image, request.x_scale, request.y_scale);
+        case 7: return process_7(image);
+        case 8: return process_8(image, request.scaling_factor);
+        case 9: return process_9(image, request.scaling_factor);
+        case 10: return process_10(image);
+        case 11: return process_11(image, request.radius);
+        case 12: return process_12(image, request.sigma);
+        case 13: return process_13(image, request.sigma, request.amount);
+        case 14: return process_14(image);
+        case 15: return process_15(image);
+        case 16: return process_16(image, request.scale, request.target_width, request.target_height, request.interpolation);
+        case 17: return process_17(image, request.angle, request.interpolation, request.background);
+    }
+    return {};
+}
+
+// Run the process function selected by the request on an image the caller no longer needs.
+// Processes that keep the pixel layout overwrite the image instead of copying it; the others
+// leave it to the caller to free.
+vector<vector<Pixel>> apply_process(vector<vector<Pixel>>&& image, const ProcessRequest& request)
+{
+    if (!request.crop.empty())
+    {
+        return apply_process_in_region(image, request);
+    }
+    if (!request.roi.empty())
+    {
+        return apply_process_in_roi(move(image), request);
+    }
+
+    switch (request.process)
+    {
+        case 1: return process_1(move(image));
+        case 2: return process_2(move(image), request.scaling_factor);
+        case 3: return process_3(move(image));
+        case 5: return process_5(move(image), request.number);
+        case 7: return process_7(move(image));
+        case 8: return process_8(move(image), request.scaling_factor);
+        case 9: return process_9(move(image), request.scaling_factor);
+        case 10: return process_10(move(image));
+        case 14: return process_14(move(image));
+        case 15: return process_15(move(image));
+    }
+    return apply_process(image, request);
+}
+
+// Whether apply_process() on an image it may take over needs no second image
+bool process_runs_in_place(const ProcessRequest& request)
+{
+    int process = request.process;
+    bool pointwise = (process >= 1 && process <= 3) || (process >= 7 && process <= 10) || process == 14 || process == 15;
+    return request.roi.empty() && (pointwise || (process == 5 && request.number % 2 == 0));
+}
+
+// Describe what is wrong with a request's parameters (empty if it is valid)
+string request_error(const ProcessRequest& request)
+{
+    if (request.process < 1 || request.process > 17)
+    {
+        return "Process must be between 1 and 17.";
+    }
+    if ((request.process == 2 || request.process == 8 || request.process == 9) &&
+        !(request.scaling_factor > 0.0 && request.scaling_factor < 1.0))
+    {
+        return "Scaling factor must be between 0 and 1.";
+    }
+    if (request.process == 5 && request.number < 1)
+    {
+        return "Number must be at least 1.";
+    }
+    if (request.process == 6 && (request.x_scale < 1 || request.y_scale < 1))
+    {
+        return "Scales must be at least 1.";
+    }
+    if (request.process == 11 && (request.radius < 1 || request.radius > 1000))
+    {
+        return "Radius must be between 1 and 1000.";
+    }
+    if ((request.process == 12 || request.process == 13) && !(request.sigma > 0.0 && request.sigma <= 200.0))
+    {
+        return "Sigma must be greater than 0 and at most 200.";
+    }
+    if (request.process == 13 && !(request.amount > 0.0 && request.amount <= 10.0))
+    {
+        return "Amount must be greater than 0 and at most 10.";
+    }
+    if (request.process == 16 && !(request.scale > 0.0 && request.scale <= 100.0))
+    {
+        return "Scale must be greater than 0 and at most 100.";
+    }
+    if (request.process == 16 && (request.target_width < 0 || request.target_height < 0 ||
+                                  request.target_width > 100000 || request.target_height > 100000))
+    {
+        return "Size must be at most 100000 x 100000.";
+    }
+    if (request.process == 17 && !(request.angle >= -360.0 && request.angle <= 360.0))
+    {
+        return "Angle must be between -360 and 360 degrees.";
+    }
+    if (request.process == 17 && request.interpolation == BICUBIC)
+    {
+        return "Rotation supports nearest and bilinear interpolation.";
+    }
+    if (!request.roi.empty() && !process_keeps_size(request))
+    {
+        return "A region of interest needs a process that keeps the image size.";
+    }
+    return "";
+}
+
+// Resident memory of this process in bytes, from a /proc/self/status field such as "VmRSS:"
+// (now) or "VmHWM:" (peak). Returns 0 where the field is not available.
+long long resident_memory(const string& field)
+{
+    ifstream status("/proc/self/status");
+    string line;
+    while (getline(status, line))
+    {
+        if (line.compare(0, field.size(), field) == 0)
+        {
+            return atoll(line.c_str() + field.size()) * 1024;
+        }
+    }
+    return 0;
+}
+
+// Restart peak ("VmHWM:") tracking from the current resident size. Returns false if the
+// kernel does not support it.
+bool reset_peak_memory()
+{
+    ofstream clear_refs("/proc/self/clear_refs");
+    clear_refs << "5" << flush;
+    return clear_refs.good();
+}
+
+// Print the peak resident memory of the step that just finished and start tracking the next one
+void report_peak_memory(const string& step)
+{
+    long long peak = resident_memory("VmHWM:");
+    clog << "  " << left << setw(10) << step << right;
+    if (peak > 0)
+    {
+        clog << " peak " << fixed << setprecision(1) << peak / 1048576.0 << " MB" << defaultfloat << endl;
+    }
+    else
+    {
+        clog << " peak unavailable" << endl;
+    }
+    reset_peak_memory();
+}
+
+// Dimensions of a request's result for an input of the given size
+void output_size(const ProcessRequest& request, int width, int height, int& out_width, int& out_height)
+{
+    out_width = width;
+    out_height = height;
+    if (request.process == 4 || (request.process == 5 && request.number % 2 == 1))
+    {
+        swap(out_width, out_height);
+    }
+    else if (request.process == 6)
+    {
+        out_width = width * request.x_scale;
+        out_height = height * request.y_scale;
+    }
+    else if (request.process == 16)
+    {
+        resample_size(request.scale, request.target_width, request.target_height, width, height, out_width, out_height);
+    }
+    else if (request.process == 17)
+    {
+        rotate_size(request.angle, width, height, out_width, out_height);
+    }
+}
+
+// Halo of edge pixels a neighborhood process reads around every output pixel, 0 for the others
+int neighborhood_halo(const ProcessRequest& request)
+{
+    if (request.process == 11)
+    {
+        return request.radius;
+    }
+    if (request.process == 12 || request.process == 13)
+    {
+        vector<int> radii = gaussian_box_radii(request.sigma);
+        return radii[0] + radii[1] + radii[2];
+    }
+    return 0;
+}
+
+// Part of the input needed for output rows [top, bottom), and the row of the processed part
+// where output row top lands (skip). Coordinates are relative to the input image.
+Region strip_input_region(const ProcessRequest& request, int width, int height, int top, int bottom, int& skip)
+{
+    skip = 0;
+    int rotation = request.process == 4 ? 1 : request.process == 5 ? request.number % 4 : 0;
+    int turns;
+    bool right_angle = request.process == 17 && right_angle_turns(request.angle, turns);
+    if (right_angle)
+    {
+        rotation = turns;
+    }
+    int halo = neighborhood_halo(request);
+    if (rotation == 1)
+    {
+        // Output row i is input column i
+        return {top, 0, bottom - top, height};
+    }
+    if (rotation == 2)
+    {
+        return {0, height - bottom, width, bottom - top};
+    }
+    if (rotation == 3)
+    {
+        // Output row i is input column width - 1 - i
+        return {width - bottom, 0, bottom - top, height};
+    }
+    if (request.process == 6)
+    {
+        int first = top / request.y_scale;
+        int last = (bottom - 1) / request.y_scale;
+        skip = top - first * request.y_scale;
+        return {0, first, width, last - first + 1};
+    }
+    if (request.process == 16)
+    {
+        int out_width;
+        int out_height;
+        output_size(request, width, height, out_width, out_height);
+        int first;
+        int last;
+        int unused;
+        resample_window(height, out_height, request.interpolation, top, first, unused);
+        resample_window(height, out_height, request.interpolation, bottom - 1, unused, last);
+        return {0, first, width, last - first};
+    }
+    if (request.process == 17 && !right_angle)
+    {
+        int out_width;
+        int out_height;
+        output_size(request, width, height, out_width, out_height);
+        int first;
+        int last;
+        rotate_source_rows(request.angle, width, height, out_width, out_height, top, bottom, first, last);
+        return {0, first, width, last - first};
+    }
+    if (halo > 0)
+    {
+        int first = max(0, top - halo);
+        int last = min(height, bottom + halo);
+        skip = top - first;
+        return {0, first, width, last - first};
+    }
+    return {0, top, width, bottom - top};
+}
+
+// Estimated memory, in bytes, of running a request in memory on an image of the given size:
+// the input, the result unless the process overwrites an input it owns, the per-thread tile
+// buffers of neighborhood processes and the horizontal pass of a resample
+long long process_memory(const ProcessRequest& request, int width, int height, int threads, bool owns_input = false)
+{
+    int out_width;
+    int out_height;
+    output_size(request, width, height, out_width, out_height);
+    long long input = ((long long)width * sizeof(Pixel) + sizeof(vector<Pixel>)) * height;
+    long long output = ((long long)out_width * sizeof(Pixel) + sizeof(vector<Pixel>)) * out_height;
+    if (owns_input && process_runs_in_place(request))
+    {
+        output = 0;
+    }
+
+    long long extra = 0;
+    int halo = neighborhood_halo(request);
+    if (halo > 0)
+    {
+        // Tile with halo, its working copy, the pass output and the row sums
+        long long side = max(256, 4 * halo) + 2 * halo;
+        extra = (long long)threads * 4 * side * side * sizeof(Pixel);
+    }
+    if (request.process == 16)
+    {
+        extra = ((long long)out_width * 3 * sizeof(float) + sizeof(vector<float>)) * height;
+    }
+    return input + output + extra;
+}
+
+// How a request runs within a memory budget
+struct MemoryPlan
+{
+    bool streaming = false;     // Process strips of rows from file to file
+    int strip_rows = 0;         // Output rows per strip
+    int threads = 1;            // Worker threads allowed
+    long long estimate = 0;     // Expected working memory in bytes
+};
+
+// Memory for one strip of rows output rows, measured on a strip from the middle of the image
+long long strip_memory(const ProcessRequest& request, int width, int height, int rows, int threads)
+{
+    int out_width;
+    int out_height;
+    output_size(request, width, height, out_width, out_height);
+    int top = (out_height - rows) / 2;
+    int skip;
+    Region strip = strip_input_region(request, width, height, top, top + rows, skip);
+    if (request.process == 16 || request.process == 17)
+    {
+        // The strip's input rows, with a copy of those the next strip reads again, a resample's
+        // horizontal pass and rows rows of output
+        int next_skip;
+        Region next = strip_input_region(request, width, height, max(0, top - rows), top, next_skip);
+        int kept = min(strip.height, max(0, next.y + next.height - strip.y));
+        long long input = ((long long)width * sizeof(Pixel) + sizeof(vector<Pixel>)) * (strip.height + kept);
+        long long horizontal = 0;
+        if (request.process == 16)
+        {
+            horizontal = ((long long)out_width * 3 * sizeof(float) + sizeof(vector<float>)) * strip.height;
+        }
+        long long output = ((long long)out_width * sizeof(Pixel) + sizeof(vector<Pixel>)) * rows;
+        return input + horizontal + output + (long long)out_width * 3;
+    }
+    return process_memory(request, strip.width, strip.height, threads, true) + (long long)out_width * 3;
+}
+
+// Choose threads, and in-memory or streaming with the tallest strip, so that running the
+// request on an image of the given size fits in the available bytes. If no strip fits, the
+// plan's estimate exceeds the budget. owns_input tells whether the decoded image is handed to
+// the process, which then overwrites it where it can.
+MemoryPlan plan_memory(const ProcessRequest& request, int width, int height, long long available, bool owns_input = false)
+{
+    MemoryPlan plan;
+    plan.threads = worker_thread_count();
+
+    // Tile buffers grow with every thread, so give up threads before giving up memory
+    while (plan.threads > 1 && process_memory(request, 1, 1, plan.threads) > available / 2)
+    {
+        plan.threads--;
+    }
+
+    plan.estimate = process_memory(request, width, height, plan.threads, owns_input);
+    if (plan.estimate <= available || !request.roi.empty())
+    {
+        return plan;
+    }
+
+    // Binary search for the tallest strip that fits
+    int out_width;
+    int out_height;
+    output_size(request, width, height, out_width, out_height);
+    int low = 1;
+    int high = out_height;
+    while (low < high)
+    {
+        int middle = low + (high - low + 1) / 2;
+        if (strip_memory(request, width, height, middle, plan.threads) <= available)
+        {
+            low = middle;
+        }
+        else
+        {
+            high = middle - 1;
+        }
+    }
+    if (strip_memory(request, width, height, low, plan.threads) > available)
+    {
+        // Nothing fits, so at least keep the input rows a strip reads beyond its own output
+        // (a halo, or the slant of a rotation) from dominating
+        int skip;
+        Region single = strip_input_region(request, width, height, out_height / 2, out_height / 2 + 1, skip);
+        low = min(out_height, max(1, single.height - 1));
+    }
+    plan.streaming = true;
+    plan.strip_rows = low;
+    plan.estimate = strip_memory(request, width, height, low, plan.threads);
+    return plan;
+}
+
+// Read the size of a request's input (after any crop) from its header and plan it. Only
+// BMP to BMP requests can stream; the others always run in memory.
+bool plan_file_request(const string& input_filename, const string& output_filename, const ProcessRequest& request,
+                       long long available, MemoryPlan& plan)
+{
+    ifstream stream(input_filename, ios::binary);
+    BmpInfo info;
+    if (is_qoi_filename(input_filename))
+    {
+        unsigned char header[QOI_HEADER_SIZE];
+        error_code ec;
+        uintmax_t file_size = filesystem::file_size(input_filename, ec);
+        if (ec || !stream.read((char*)header, sizeof(header)) ||
+            !read_qoi_size(header, sizeof(header), file_size, info.width, info.height))
+        {
+            return false;
+        }
+    }
+    else if (!read_bmp_info(stream, info))
+    {
+        return false;
+    }
+    Region source = request.crop;
+    if (source.empty())
+    {
+        source = {0, 0, info.width, info.height};
+    }
+    else if (!clip_region(source, info.width, info.height))
+    {
+        return false;
+    }
+    ProcessRequest inner = request;
+    inner.crop = Region();
+    plan = plan_memory(inner, source.width, source.height, available);
+    if (plan.streaming && (is_qoi_filename(input_filename) || is_qoi_filename(output_filename)))
+    {
+        plan.streaming = false;
+        plan.estimate = process_memory(inner, source.width, source.height, plan.threads);
+    }
+    return true;
+}
+
+// Whether a request can stream from a forward-only input: every strip must need input rows
+// no lower than the strip before, and there can be no statistics pass. Rotations by an angle
+// qualify while the image stays less than a quarter turn from upright.
+bool streams_forward(const ProcessRequest& request)
+{
+    return request.process != 4 && !(request.process == 5 && request.number % 4 != 0) &&
+           request.process != 14 && request.process != 15 &&
+           !(request.process == 17 && cos(request.angle * M_PI / 180.0) < 1e-9);
+}
+
+// Run a request on a BMP stream a strip of output rows at a time and write the result as BMP.
+// Strips go bottom first, so the output is written front to back and never held in memory
+// whole. The input stream must be just after its header; a forward-only one needs a request
+// that streams_forward(). Gives the same result as the in-memory path.
+bool stream_process(istream& input, const BmpInfo& info, bool seekable, ostream& output,
+                    const ProcessRequest& request, int strip_rows)
+{
+    if (!request.roi.empty() || (!seekable && !streams_forward(request)))
+    {
+        return false;
+    }
+    BmpRowSource source_rows(input, info, seekable);
+    Region source = request.crop;
+    if (source.empty())
+    {
+        source = {0, 0, info.width, info.height};
+    }
+    else if (!clip_region(source, info.width, info.height))
+    {
+        return false;
+    }
+    ProcessRequest inner = request;
+    inner.crop = Region();
+    int out_width;
+    int out_height;
+    output_size(inner, source.width, source.height, out_width, out_height);
+    strip_rows = max(1, strip_rows);
+
+    // Histogram processes need statistics of the whole input first
+    int tables[3][256];
+    if (inner.process == 14 || inner.process == 15)
+    {
+        ImageStats stats;
+        for (int top = 0; top < source.height; top += strip_rows)
+        {
+            Region strip = {source.x, source.y + top, source.width, min(strip_rows, source.height - top)};
+            vector<vector<Pixel>> rows = source_rows.read(strip);
+            if (rows.empty())
+            {
+                return false;
+            }
+            ImageStats part = compute_image_stats(rows);
+            stats.pixels = stats.pixels + part.pixels;
+            for (int i = 0; i < 256; i++)
+            {
+                stats.red[i] = stats.red[i] + part.red[i];
+                stats.green[i] = stats.green[i] + part.green[i];
+                stats.blue[i] = stats.blue[i] + part.blue[i];
+            }
+        }
+        histogram_process_tables(inner.process, stats, tables);
+    }
+
+    write_bmp_header(output, out_width, out_height);
+    vector<unsigned char> scanline(out_width * 3 + (4 - out_width * 3 % 4) % 4, 0);
+    const PixelKernels& kernels = pixel_kernels();
+
+    // Rotations by right angles read input columns like process 5 does
+    int turns;
+    bool any_angle = inner.process == 17 && !right_angle_turns(inner.angle, turns);
+
+    int strips = (out_height + strip_rows - 1) / strip_rows;
+    for (int strip = strips - 1; strip >= 0; strip--)
+    {
+        int top = strip * strip_rows;
+        int bottom = min(out_height, top + strip_rows);
+        int skip;
+        Region needed = strip_input_region(inner, source.width, source.height, top, bottom, skip);
+
+        // Rows at the top of this strip's input that the next strip reads again
+        int keep_rows = 0;
+        if (strip > 0)
+        {
+            int next_skip;
+            Region next = strip_input_region(inner, source.width, source.height, top - strip_rows, top, next_skip);
+            if (next.y <= needed.y)
+            {
+                keep_rows = min(needed.height, max(0, next.y + next.height - needed.y));
+            }
+        }
+        needed.x = needed.x + source.x;
+        needed.y = needed.y + source.y;
+        vector<vector<Pixel>> rows = source_rows.read(needed, keep_rows);
+        if (rows.empty())
+        {
+            return false;
+        }
+
+        vector<vector<Pixel>> result;
+        if (inner.process == 1)
+        {
+            // The vignette depends on where the row sits in the whole image
+            apply_pointwise_in_place(rows, VignetteFilter{out_width, out_height, top});
+            result = move(rows);
+        }
+        else if (inner.process == 14 || inner.process == 15)
+        {
+            apply_pointwise_in_place(rows, ChannelTablesFilter{tables[0], tables[1], tables[2]});
+            result = move(rows);
+        }
+        else if (inner.process == 16)
+        {
+            // The filter taps depend on where the strip sits in the whole image
+            result = resample_rows(rows, needed.y - source.y, source.height, out_width, out_height, top, bottom,
+                                   inner.interpolation);
+        }
+        else if (any_angle)
+        {
+            result = rotate_rows(rows, needed.y - source.y, source.height, out_width, out_height, top, bottom,
+                                 inner.angle, inner.interpolation, inner.background);
+        }
+        else
+        {
+            result = apply_process(move(rows), inner);
+        }
+
+        for (int row = bottom - 1; row >= top; row--)
+        {
+            kernels.pack_bgr(result[skip + row - top].data(), scanline.data(), out_width);
+            output.write((char*)scanline.data(), scanline.size());
+        }
+    }
+    return output.good();
+}
+
+// Stream a request from one BMP file to another with stream_process()
+bool stream_process(const string& input_filename, const string& output_filename, const ProcessRequest& request, int strip_rows)
+{
+    ifstream input(input_filename, ios::binary);
+    BmpInfo info;
+    if (!read_bmp_info(input, info))
+    {
+        return false;
+    }
+    ofstream output(output_filename, ios::binary);
+    return output.is_open() && stream_process(input, info, true, output, request, strip_rows);
+}
+
+// Working memory shared by jobs running at the same time. A job waits until its reservation
+// fits; one larger than the whole budget waits until it runs alone.
+class MemoryBudget
+{
+public:
+    explicit MemoryBudget(long long limit) : limit(limit) {}
+
+    long long total() const
+    {
+        return limit;
+    }
+
+    // Block until bytes (at most the whole budget) are free and take them. Returns the bytes taken.
+    long long acquire(long long bytes)
+    {
+        bytes = min(bytes, limit);
+        unique_lock<mutex> lock(guard);
+        freed.wait(lock, [&] { return used + bytes <= limit; });
+        used = used + bytes;
+        return bytes;
+    }
+
+    void release(long long bytes)
+    {
+        {
+            lock_guard<mutex> lock(guard);
+            used = used - bytes;
+        }
+        freed.notify_all();
+    }
+
+private:
+    long long limit;
+    long long used = 0;
+    mutex guard;
+    condition_variable freed;
+};
+
+// Part of a MemoryBudget held for as long as this object lives. A null budget holds nothing.
+struct MemoryReservation
+{
+    MemoryBudget* budget;
+    long long bytes;
+
+    MemoryReservation(MemoryBudget* budget, long long bytes) : budget(budget), bytes(budget ? budget->acquire(bytes) : 0) {}
+    ~MemoryReservation()
+    {
+        if (budget)
+        {
+            budget->release(bytes);
+        }
+    }
+};
+
+// On-disk result cache settings (the cache is disabled when directory is empty)
+struct ResultCache
+{
+    string directory;
+    long long max_bytes = 256LL * 1024 * 1024;
+    bool hard_link = false;
+};
+
+// Serializes updates to the cache directory when requests run on several threads
+mutex cache_mutex;
+
+// 64-bit FNV-1a hash, continuing from the given hash value
+uint64_t fnv1a(const char* data, size_t size, uint64_t hash = 14695981039346656037ULL)
+{
+    for (size_t i = 0; i < size; i++)
+    {
+        hash = hash ^ (unsigned char)data[i];
+        hash = hash * 1099511628211ULL;
+    }
+    return hash;
+}
+
+// Cache key from the input file bytes, the process, its parameters and the output format.
+// Parameters a process ignores are cleared so they never split otherwise identical entries.
+string cache_key(const string& input_filename, const ProcessRequest& request, const string& output_filename)
+{
+    ifstream stream(input_filename, ios::binary);
+    if (!stream.is_open())
+    {
+        return "";
+    }
+
+    uint64_t hash = fnv1a(nullptr, 0);
+    vector<char> buffer(1 << 16);
+    while (stream.read(buffer.data(), buffer.size()) || stream.gcount() > 0)
+    {
+        hash = fnv1a(buffer.data(), stream.gcount(), hash);
+    }
+
+    ProcessRequest normalized;
+    normalized.process = request.process;
+    if (request.process == 2 || request.process == 8 || request.process == 9)
+    {
+        normalized.scaling_factor = request.scaling_factor;
+    }
+    if (request.process == 5)
+    {
+        normalized.number = request.number % 4;
+    }
+    if (request.process == 6)
+    {
+        normalized.x_scale = request.x_scale;
+        normalized.y_scale = request.y_scale;
+    }
+    if (request.process == 11)
+    {
+        normalized.radius = request.radius;
+    }
+    if (request.process == 12 || request.process == 13)
+    {
+        normalized.sigma = request.sigma;
+    }
+    if (request.process == 13)
+    {
+        normalized.amount = request.amount;
+    }
+    if (request.process == 16)
+    {
+        normalized.scale = request.scale;
+        normalized.target_width = request.target_width;
+        normalized.target_height = request.target_height;
+        normalized.interpolation = request.interpolation;
+    }
+    if (request.process == 17)
+    {
+        normalized.angle = request.angle;
+        normalized.interpolation = request.interpolation;
+        normalized.background = request.background;
+    }
+
+    ostringstream params;
+    params << "v5;" << normalized.process << ';' << hexfloat << normalized.scaling_factor << ';'
+           << normalized.number << ';' << normalized.x_scale << ';' << normalized.y_scale << ';'
+           << normalized.radius << ';' << normalized.sigma << ';' << normalized.amount << ';'
+           << normalized.scale << ';' << normalized.target_width << ';' << normalized.target_height << ';'
+           << normalized.interpolation << ';' << normalized.angle << ';' << normalized.background.red << ','
+           << normalized.background.green << ',' << normalized.background.blue << ';'
+           << request.crop.x << ',' << request.crop.y << ',' << request.crop.width << ',' << request.crop.height << ';'
+           << request.roi.x << ',' << request.roi.y << ',' << request.roi.width << ',' << request.roi.height << ';'
+           << filesystem::path(output_filename).extension().string();
+    string text = params.str();
+    hash = fnv1a(text.data(), text.size(), hash);
+
+    ostringstream key;
+    key << hex << setw(16) << setfill('0') << hash;
+    return key.str();
+}
+
+// Path of the cache entry for a key
+filesystem::path cache_entry_path(const ResultCache& cache, const string& key)
+{
+    return filesystem::path(cache.directory) / (key + ".entry");
+}
+
+// Add to the hit/miss/eviction counters kept in the cache directory
+void update_cache_stats(const ResultCache& cache, long long hits, long long misses, long long evictions)
+{
+    lock_guard<mutex> lock(cache_mutex);
+    long long counts[3] = {0, 0, 0};
+    string names[3] = {"hits", "misses", "evictions"};
+    filesystem::path stats_path = filesystem::path(cache.directory) / "stats.txt";
+
+    ifstream in(stats_path);
+    string name;
+    long long value;
+    while (in >> name >> value)
+    {
+        for (int i = 0; i < 3; i++)
+        {
+            if (name == names[i])
+            {
+                counts[i] = value;
+            }
+        }
+    }
+    in.close();
+
+    counts[0] = counts[0] + hits;
+    counts[1] = counts[1] + misses;
+    counts[2] = counts[2] + evictions;
+
+    ofstream out(stats_path, ios::trunc);
+    for (int i = 0; i < 3; i++)
+    {
+        out << names[i] << " " << counts[i] << endl;
+    }
+}
+
+// Print the cache counters and current size
+void print_cache_stats(const ResultCache& cache)
+{
+    ifstream in(filesystem::path(cache.directory) / "stats.txt");
+    long long hits = 0;
+    long long misses = 0;
+    long long evictions = 0;
+    string name;
+    long long value;
+    while (in >> name >> value)
+    {
+        if (name == "hits") hits = value;
+        if (name == "misses") misses = value;
+        if (name == "evictions") evictions = value;
+    }
+
+    long long entries = 0;
+    long long bytes = 0;
+    error_code ec;
+    for (const filesystem::directory_entry& entry : filesystem::directory_iterator(cache.directory, ec))
+    {
+        if (entry.path().extension() == ".entry")
+        {
+            entries++;
+            bytes = bytes + entry.file_size(ec);
+        }
+    }
+
+    long long lookups = hits + misses;
+    cout << "Cache " << cache.directory << ": " << entries << " entries, " << bytes << " of " << cache.max_bytes << " bytes" << endl;
+    cout << "  hits " << hits << ", misses " << misses << ", evictions " << evictions;
+    if (lookups > 0)
+    {
+        cout << " (hit rate " << fixed << setprecision(1) << 100.0 * hits / lookups << "%)" << defaultfloat;
+    }
+    cout << endl;
+}
+
+// Remove least recently used entries until the cache fits in its size bound
+void evict_cache_entries(const ResultCache& cache)
+{
+    long long evicted = 0;
+    {
+        lock_guard<mutex> lock(cache_mutex);
+        vector<pair<filesystem::file_time_type, filesystem::path>> entries;
+        long long total = 0;
+        error_code ec;
+        for (const filesystem::directory_entry& entry : filesystem::directory_iterator(cache.directory, ec))
+        {
+            if (entry.path().extension() == ".entry")
+            {
+                entries.push_back({entry.last_write_time(ec), entry.path()});
+                total = total + entry.file_size(ec);
+            }
+        }
+
+        sort(entries.begin(), entries.end());
+        for (size_t i = 0; i < entries.size() && total > cache.max_bytes; i++)
+        {
+            long long size = filesystem::file_size(entries[i].second, ec);
+            if (filesystem::remove(entries[i].second, ec))
+            {
+                total = total - size;
+                evicted++;
+            }
+        }
+    }
+
+    if (evicted > 0)
+    {
+        update_cache_stats(cache, 0, 0, evicted);
+    }
+}
+
+// Place a cached result at the output filename. Returns false on a cache miss.
+bool fetch_cached_result(const ResultCache& cache, const string& key, const string& output_filename)
+{
+    if (cache.directory.empty() || key.empty())
+    {
+        return false;
+    }
+
+    filesystem::path entry = cache_entry_path(cache, key);
+    error_code ec;
+    if (!filesystem::exists(entry, ec))
+    {
+        update_cache_stats(cache, 0, 1, 0);
+        return false;
+    }
+
+    // Never link over an existing file: writing to it later would corrupt the cache entry
+    filesystem::remove(output_filename, ec);
+    bool placed = false;
+    if (cache.hard_link)
+    {
+        filesystem::create_hard_link(entry, output_filename, ec);
+        placed = !ec;
+    }
+    if (!placed)
+    {
+        placed = filesystem::copy_file(entry, output_filename, filesystem::copy_options::overwrite_existing, ec);
+    }
+    if (!placed)
+    {
+        update_cache_stats(cache, 0, 1, 0);
+        return false;
+    }
+
+    // The modification time is the recency used for LRU eviction
+    filesystem::last_write_time(entry, filesystem::file_time_type::clock::now(), ec);
+    update_cache_stats(cache, 1, 0, 0);
+    return true;
+}
+
+// Unlink an output that shares its file with another name, such as a cache entry placed by
+// --cache-hard-link, so the write that follows creates a new file instead of overwriting both
+void detach_output(const string& output_filename)
+{
+    error_code ec;
+    if (filesystem::hard_link_count(output_filename, ec) > 1)
+    {
+        filesystem::remove(output_filename, ec);
+    }
+}
+
+// Copy a freshly written result into the cache and enforce the size bound
+void store_cached_result(const ResultCache& cache, const string& key, const string& output_filename)
+{
+    if (cache.directory.empty() || key.empty())
+    {
+        return;
+    }
+
+    filesystem::path entry = cache_entry_path(cache, key);
+    // Every store writes its own temporary file: workers and processes sharing the cache can
+    // store the same key at once
+    static const unsigned process_tag = random_device()();
+    static atomic<unsigned> stores(0);
+    filesystem::path temp = entry;
+    temp += "." + to_string(process_tag) + "." + to_string(stores++) + ".tmp";
+    error_code ec;
+    if (filesystem::copy_file(output_filename, temp, filesystem::copy_options::overwrite_existing, ec))
+    {
+        filesystem::rename(temp, entry, ec);
+    }
+    evict_cache_entries(cache);
+}
+
+// Apply a process to a loaded image and save it, reusing a cached result when one exists
+bool process_and_save(const string& input_filename, const vector<vector<Pixel>>& image, const ProcessRequest& request, const string& output_filename, const ResultCache& cache)
+{
+    string key;
+    if (!cache.directory.empty())
+    {
+        key = cache_key(input_filename, request, output_filename);
+        if (fetch_cached_result(cache, key, output_filename))
+        {
+            return true;
+        }
+    }
+
+    detach_output(output_filename);
+    if (!write_image_fast(output_filename, apply_process(image, request)))
+    {
+        return false;
+    }
+    store_cached_result(cache, key, output_filename);
+    return true;
+}
+
+// Run menu UI
+string menu(string filename)
+{
+    cout << "" << endl;
+    cout << "IMAGE PROCESSING MENU" << endl;
+    cout << "" << endl;
+    cout << " 0) Change Image (current: " << filename << ")" << endl;
+    cout << " 1) Vignette" << endl;
+    cout << " 2) Clarendon" << endl;
+    cout << " 3) Grayscale" << endl;
+    cout << " 4) Rotate 90 Degrees" << endl;
+    cout << " 5) Rotate Multiple 90 Degrees" << endl;
+    cout << " 6) Enlarge" << endl;
+    cout << " 7) High Contrast" << endl;
+    cout << " 8) Lighten" << endl;
+    cout << " 9) Darken" << endl;
+    cout << "10) Black, White, Red, Green, Blue" << endl;
+    cout << "11) Box Blur" << endl;
+    cout << "12) Gaussian Blur" << endl;
+    cout << "13) Sharpen" << endl;
+    cout << "14) Auto Levels" << endl;
+    cout << "15) Equalize" << endl;
+    cout << "16) Resample" << endl;
+    cout << "17) Rotate by Angle" << endl;
+    cout << " P) Preview a process" << endl;
+    cout << "" << endl;
+    cout << "Make a selection (Q to quit): ";
+
+    string selection;
+    cin >> selection;
+
+    return selection;
+}
+
+// Verify filename is .bmp
+string get_valid_filename(string prompt)
+{
+    string filename;
+    while (true)
+    {
+        cout << prompt;
+        cin >> filename;
+        if (filename == "Q" || filename == "q")
+        {
+            cout << endl;
+            cout << "Thank you for using my program....Goodbye!" << endl;
+            cout << endl;
+            exit(0);
+        }
+
+        if (filename.length() >= 4 && filename.substr(filename.length() - 4) == ".bmp")
+        {
+            return filename;
+        }
+        cout << endl;
+        cout << "Error: Input file must be a .bmp file." << endl;
+        cout << endl;
+    }
+}
+
+// Verify output filename is .bmp, and not the same as input filename or an already saved output filename
+string get_output_filename(string input_filename, vector<string> existing_outputs, string prompt)
+{
+    string output_filename;
+    while (true)
+    {
+        cout << prompt;
+        cin >> output_filename;
+        if (output_filename == "Q" || output_filename == "q")
+        {
+            cout << endl;
+            cout << "Thank you for using my program....Goodbye!" << endl;
+            cout << endl;
+            exit(0);
+        }
+
+        if (output_filename == "menu" || output_filename == "Menu" || output_filename == "MENU")
+        {
+            cout << endl;
+            cout << "Returning to menu..." << endl;
+            cout << endl;
+            menu(input_filename);
+        }
+
+        if (output_filename.length() < 4 || output_filename.substr(output_filename.length() -4) != ".bmp")
+        {
+            cout << endl;
+            cout << "Error: Output file must be a .bmp file." << endl;
+            cout << endl;
+        }
+        else if (output_filename == input_filename)
+        {
+            cout << endl;
+            cout << "Error: Output filename cannot be the same as the input filename." << endl;
+            cout << endl;
+        }
+        else
+        {
+            bool exists = false;
+            for (int i = 0; i < existing_outputs.size(); i++)
+            {
+                if (existing_outputs[i] == output_filename)
+                {
+                    exists = true;
+                    break;
+                }
+            }
+            if (exists)
+            {
+                cout << endl;
+                cout << "Error: Output filename already exists." << endl;
+                cout << endl;
+            }
+            else
+            {
+                return output_filename;
+            }
+        }
+    }
+}
+
+// Ask for and verify number
+int get_valid_number(string prompt, int min_value, string input_filename)
+{
+    string input;
+    int value;
+    while (true)
+    {
+        cout << prompt;
+        cin >> input;
+        if (input == "Q" || input == "q")
+        {
+            cout << endl;
+            cout << "Thank you for using my program....Goodbye!" << endl;
+            cout << endl;
+            exit(0);
+        }
+
+        if (input == "menu" || input == "Menu" || input == "MENU")
+        {
+            cout << endl;
+            cout << "Returning to menu..." << endl;
+            cout << endl;
+            menu(input_filename);
+            continue;
+        }
+
+        value = stoi(input);
+
+        if (value >= min_value)
+        {
+            return value;
+        }
+        cout << endl;
+        cout << "Error: Please enter a number greater than or equal to " << min_value << "." << endl;
+        cout << endl;
+        cin.clear();
+        cin.ignore(1000, '\n');
+    }
+}
+
+// Ask for and verify scaling factor
+double get_valid_scaling_factor(string prompt, double min_value, double max_value, string input_filename)
+{
+    string input;
+    double value;
+    while (true)
+    {
+        cout << prompt;
+        cin >> input;
+        if (input == "Q" || input == "q")
+        {
+            cout << endl;
+            cout << "Thank you for using my program....Goodbye!" << endl;
+            cout << endl;
+            exit(0);
+        }
+
+        if (input == "menu" || input == "Menu" || input == "MENU")
+        {
+            cout << endl;
+            cout << "Returning to menu..." << endl;
+            cout << endl;
+            menu(input_filename);
+            continue;
+        }
+
+        value = stod(input);
+
+        if (value > min_value && value < max_value)
+        {
+            return value;
+        }
+        cout << endl;
+        cout << "Error: Please enter a number between " << min_value << " and " << max_value << "." << endl;
+        cout << endl;
+        cin.clear();
+        cin.ignore(1000, '\n');
+    }
+}
+
+// Ask for and verify an interpolation name
+Interpolation get_valid_interpolation(string prompt, string input_filename)
+{
+    string input;
+    Interpolation interpolation;
+    while (true)
+    {
+        cout << prompt;
+        cin >> input;
+        if (input == "Q" || input == "q")
+        {
+            cout << endl;
+            cout << "Thank you for using my program....Goodbye!" << endl;
+            cout << endl;
+            exit(0);
+        }
+
+        if (input == "menu" || input == "Menu" || input == "MENU")
+        {
+            cout << endl;
+            cout << "Returning to menu..." << endl;
+            cout << endl;
+            menu(input_filename);
+            continue;
+        }
+
+        if (parse_interpolation(input, interpolation))
+        {
+            return interpolation;
+        }
+        cout << endl;
+        cout << "Error: Please enter nearest, bilinear or bicubic." << endl;
+        cout << endl;
+    }
+}
+
+// Ask for the parameters a process needs, with the same prompts as the menu
+ProcessRequest ask_process_parameters(int process, string input_filename)
+{
+    ProcessRequest request;
+    request.process = process;
+    if (process == 2 || process == 8 || process == 9)
+    {
+        request.scaling_factor = get_valid_scaling_factor("Enter scaling factor: ", 0.0, 1.0, input_filename);
+    }
+    else if (process == 5)
+    {
+        request.number = get_valid_number("Enter a number: ", 1, input_filename);
+    }
+    else if (process == 6)
+    {
+        request.x_scale = get_valid_number("Enter a number: ", 1, input_filename);
+        request.y_scale = get_valid_number("Enter another number: ", 1, input_filename);
+    }
+    else if (process == 11)
+    {
+        request.radius = min(get_valid_number("Enter blur radius: ", 1, input_filename), 1000);
+    }
+    else if (process == 12 || process == 13)
+    {
+        request.sigma = get_valid_scaling_factor("Enter sigma: ", 0.0, 200.0, input_filename);
+        if (process == 13)
+        {
+            request.amount = get_valid_scaling_factor("Enter amount: ", 0.0, 10.0, input_filename);
+        }
+    }
+    else if (process == 16)
+    {
+        request.scale = get_valid_scaling_factor("Enter scale factor: ", 0.0, 100.0, input_filename);
+        request.interpolation = get_valid_interpolation("Enter interpolation (nearest, bilinear, bicubic): ", input_filename);
+    }
+    else if (process == 17)
+    {
+        request.angle = get_valid_scaling_factor("Enter angle in degrees: ", -360.0, 360.0, input_filename);
+    }
+    return request;
+}
+
+// Largest preview side in pixels: fits an 80 column terminal at one pixel per column
+const int PREVIEW_SIZE = 80;
+
+// Shrink an image by a whole factor so its larger side is at most PREVIEW_SIZE,
+// averaging each factor x factor block. Returns the factor used. An image that failed to
+// load has an empty preview.
+int make_preview(const vector<vector<Pixel>>& image, vector<vector<Pixel>>& preview)
+{
+    if (image.empty())
+    {
+        preview.clear();
+        return 1;
+    }
+    int height = image.size();
+    int width = image[0].size();
+    int factor = max(1, (max(width, height) + PREVIEW_SIZE - 1) / PREVIEW_SIZE);
+    int preview_height = max(1, height / factor);
+    int preview_width = max(1, width / factor);
+
+    preview.assign(preview_height, vector<Pixel>(preview_width));
+    parallel_for_rows(preview_height, [&](int, int begin, int end)
+    {
+        for (int row = begin; row < end; row++)
+        {
+            for (int col = 0; col < preview_width; col++)
+            {
+                int red = 0;
+                int green = 0;
+                int blue = 0;
+                int count = 0;
+                for (int y = row * factor; y < min(height, (row + 1) * factor); y++)
+                {
+                    for (int x = col * factor; x < min(width, (col + 1) * factor); x++)
+                    {
+                        red = red + image[y][x].red;
+                        green = green + image[y][x].green;
+                        blue = blue + image[y][x].blue;
+                        count++;
+                    }
+                }
+                preview[row][col] = {red / count, green / count, blue / count};
+            }
+        }
+    }, 8);
+    return factor;
+}
+
+// Parameters measured in pixels shrink with the preview so it looks like the full render
+ProcessRequest scale_request_for_preview(ProcessRequest request, int factor)
+{
+    request.radius = max(1, request.radius / factor);
+    request.sigma = max(0.5, request.sigma / factor);
+    request.target_width = request.target_width > 0 ? max(1, request.target_width / factor) : 0;
+    request.target_height = request.target_height > 0 ? max(1, request.target_height / factor) : 0;
+    return request;
+}
+
+// Draw an image in the terminal with 24-bit ANSI colors, two pixel rows per text line
+void print_ansi_image(const vector<vector<Pixel>>& image)
+{
+    int height = image.size();
+    int width = image[0].size();
+    ostringstream out;
+    for (int row = 0; row < height; row += 2)
+    {
+        for (int col = 0; col < width; col++)
+        {
+            const Pixel& top = image[row][col];
+            const Pixel& bottom = row + 1 < height ? image[row + 1][col] : top;
+            out << "\033[38;2;" << histogram_bin(top.red) << ';' << histogram_bin(top.green) << ';' << histogram_bin(top.blue)
+                << "m\033[48;2;" << histogram_bin(bottom.red) << ';' << histogram_bin(bottom.green) << ';' << histogram_bin(bottom.blue)
+                << "m▀";
+        }
+        out << "\033[0m\n";
+    }
+    cout << out.str();
+}
+
+// Preview a process on the shrunken image, then render it at full size only if asked to
+void run_preview(string input_filename, const vector<vector<Pixel>>& image, const vector<vector<Pixel>>& preview,
+                 int preview_factor, vector<string>& output_filenames, const ResultCache& cache)
+{
+    if (preview.empty())
+    {
+        cout << "Error: " << input_filename << " could not be read as an image, so there is nothing to preview." << endl;
+        return;
+    }
+    int process = get_valid_number("Enter the process to preview (1-17): ", 1, input_filename);
+    if (process > 17)
+    {
+        cout << endl;
+        cout << "Error: Process must be between 1 and 17." << endl;
+        return;
+    }
+    ProcessRequest request = ask_process_parameters(process, input_filename);
+
+    chrono::steady_clock::time_point start = chrono::steady_clock::now();
+    vector<vector<Pixel>> result = apply_process(preview, scale_request_for_preview(request, preview_factor));
+    double elapsed_ms = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+
+    string target;
+    cout << "Show preview in terminal (T) or enter a .bmp filename to save it: ";
+    cin >> target;
+    cout << endl;
+    if (target == "T" || target == "t")
+    {
+        print_ansi_image(result);
+    }
+    else if (target.length() >= 4 && target.substr(target.length() - 4) == ".bmp" && target != input_filename)
+    {
+        if (write_image_fast(target, result))
+        {
+            cout << "Saved preview to " << target << endl;
+        }
+        else
+        {
+            cout << "Error: Failed to save the preview to " << target << "." << endl;
+        }
+    }
+    else
+    {
+        cout << "Error: Preview file must be a .bmp file other than the input file." << endl;
+    }
+    cout << "Preview of " << result[0].size() << "x" << result.size() << " pixels rendered in "
+         << fixed << setprecision(1) << elapsed_ms << defaultfloat << " ms" << endl;
+    cout << endl;
+
+    string answer;
+    cout << "Render at full size? (Y/N): ";
+    cin >> answer;
+    if (answer != "Y" && answer != "y")
+    {
+        return;
+    }
+
+    string output = get_output_filename(input_filename, output_filenames, "Enter output filename (.bmp only), (Type Q/q to quit, menu to return to menu): ");
+    output_filenames.push_back(output);
+    if (process_and_save(input_filename, image, request, output, cache))
+    {
+        cout << endl;
+        cout << "Successfully applied process " << process << " and saved to " << output << "!" << endl;
+    }
+    else
+    {
+        cout << endl;
+        cout << "Error: Failed to save the processed image to " << output << "." << endl;
+    }
+}
+
+// Options given on the command line
+struct CommandLine
+{
+    string input_filename;
+    string output_filename;
+    ProcessRequest request;
+    ResultCache cache;
+    bool cache_stats = false;
+    bool serve = false;
+    string socket_path;
+    int workers = 0;
+    int image_cache_size = 8;
+    string batch_filename;          // Manifest of requests to run as a batch
+    int shard_index = 0;            // Which of shard_count shards of the batch to run
+    int shard_count = 1;
+    bool shard_by_hash = false;     // Assign items to shards by a hash of their line, not their position
+    string batch_log_filename;      // Completion log (default: next to the manifest, one per shard)
+    bool simd_info = false;
+    string stats_filename;
+    string codec_bench_filename;
+    string compare_first;
+    string compare_second;
+    bool compare_directories = false;
+    string diff_image_filename;
+    int max_error = 0;
+    double min_psnr = 0.0;
+    long long max_mismatches = -1;
+    bool verify = false;
+    string golden_directory = "sample_images";
+    string baseline_filename;
+    bool update_baseline = false;
+    double max_slowdown = 25.0;
+    int repeat = 5;
+    int max_memory_mb = 0;
+    bool memory_report = false;
+    string output_format = "bmp";   // Format written to standard output
+    bool perf = false;
+    string huge_pages;              // Image pool backing: empty (off), transparent or explicit
+};
+
+// Print command line usage
+void print_usage(string program)
+{
+    cout << "Usage: " << program << " [options]" << endl;
+    cout << "  With no --input the interactive menu runs." << endl;
     cout << "" << endl;
-    cout << "IMAGE PROCESSING MENU" << endl;
-    cout << "" << endl;
-    cout << " 0) Change Image (current: " << filename << ")" << endl;
-    cout << " 1) Vignette" << endl;
-    cout << " 2) Clarendon" << endl;
-    cout << " 3) Grayscale" << endl;
-    cout << " 4) Rotate 90 Degrees" << endl;
-    cout << " 5) Rotate Multiple 90 Degrees" << endl;
-    cout << " 6) Enlarge" << endl;
-    cout << " 7) High Contrast" << endl;
-    cout << " 8) Lighten" << endl;
-    cout << " 9) Darken" << endl;
-    cout << "10) Black, White, Red, Green, Blue" << endl;
+    cout << "  --input FILE            Image to process (- for standard input)" << endl;
+    cout << "  --output FILE           Where to save the result (- for standard output)" << endl;
+    cout << "  --output-format F       bmp or qoi, for standard output (default bmp)" << endl;
+    cout << "  --process N             Process 1-17 to apply" << endl;
+    cout << "  --scaling-factor F      Scaling factor for processes 2, 8 and 9" << endl;
+    cout << "  --number N              Number of 90 degree rotations for process 5" << endl;
+    cout << "  --x-scale N             Horizontal scale for process 6" << endl;
+    cout << "  --y-scale N             Vertical scale for process 6" << endl;
+    cout << "  --radius N              Box blur radius for process 11" << endl;
+    cout << "  --sigma F               Gaussian sigma for processes 12 and 13" << endl;
+    cout << "  --amount F              Sharpen strength for process 13" << endl;
+    cout << "  --scale F               Resample factor for process 16" << endl;
+    cout << "  --size WxH              Resample target size for process 16 (0 for a side keeps the aspect)" << endl;
+    cout << "  --interpolation M       nearest, bilinear or bicubic for process 16, nearest or bilinear for 17" << endl;
+    cout << "                          (default bilinear)" << endl;
+    cout << "  --angle F               Clockwise rotation in degrees for process 17" << endl;
+    cout << "  --background R,G,B      Fill around the rotated image for process 17 (default 0,0,0)" << endl;
+    cout << "  --crop X,Y,W,H          Decode and process only this rectangle of the input" << endl;
+    cout << "  --roi X,Y,W,H           Apply the process only inside this rectangle" << endl;
+    cout << "  --max-memory MB         Keep processing within this much memory, streaming if needed" << endl;
+    cout << "  --memory-report         Print the peak resident memory of every step" << endl;
+    cout << "  --perf                  Print hardware counters (IPC, cache/TLB/branch misses) per step" << endl;
+    cout << "  --huge-pages M          Keep image rows in transparent or explicit huge pages, placed per NUMA node" << endl;
+    cout << "  --cache-dir DIR         Reuse results from an on-disk cache" << endl;
+    cout << "  --cache-max-mb N        Cache size bound in megabytes (default 256)" << endl;
+    cout << "  --cache-hard-link       Hard link cache hits into place instead of copying" << endl;
+    cout << "  --cache-stats           Print cache hit/miss statistics" << endl;
+    cout << "  --serve                 Serve JSON-lines requests on stdin/stdout" << endl;
+    cout << "  --socket PATH           Serve JSON-lines requests on a Unix domain socket" << endl;
+    cout << "  --workers N             Requests served at once (default: one per core)" << endl;
+    cout << "  --image-cache N         Decoded images kept in memory while serving (default 8)" << endl;
+    cout << "  --batch FILE            Run a manifest of JSON-lines requests, skipping finished ones" << endl;
+    cout << "  --shard I/K             Run only items of shard I (0 to K-1) of K (default 0/1)" << endl;
+    cout << "  --shard-by M            index or hash: how items are assigned to shards (default index)" << endl;
+    cout << "  --batch-log FILE        Completion log (default MANIFEST.shard-I-of-K.log)" << endl;
+    cout << "  --simd-info             Print the instruction set levels available and in use" << endl;
+    cout << "  --stats FILE            Print histogram statistics of an image" << endl;
+    cout << "  --codec-bench FILE      Compare BMP and QOI size and encode/decode speed on an image" << endl;
+    cout << "  --compare A B           Compare two images: max channel error, mismatches and PSNR" << endl;
+    cout << "  --compare-dirs A B      Compare every image in directory A with the same file in B" << endl;
+    cout << "  --diff-image FILE       Save a heatmap of the differences found by --compare" << endl;
+    cout << "  --max-error N           Largest channel error --compare accepts (default 0)" << endl;
+    cout << "  --min-psnr DB           Lowest PSNR --compare accepts" << endl;
+    cout << "  --max-mismatches N      Most differing pixels --compare accepts" << endl;
+    cout << "  --verify                Check every process against the golden images" << endl;
+    cout << "  --golden-dir DIR        Golden images for --verify (default sample_images)" << endl;
+    cout << "  --baseline FILE         Timing baseline for --verify" << endl;
+    cout << "  --update-baseline       Save this run's timings as the baseline" << endl;
+    cout << "  --max-slowdown PCT      Allowed slowdown against the baseline (default 25)" << endl;
+    cout << "  --repeat N              Timed runs per process, best is kept (default 5)" << endl;
     cout << "" << endl;
-    cout << "Make a selection (Q to quit): ";
+    cout << "  IMAGE_PROCESSOR_SIMD=baseline|sse4.2|avx2|avx512 forces a kernel level." << endl;
+}
+
+// Parse an integer option value. Returns false if it is not a whole number.
+bool parse_int(const string& text, int& value)
+{
+    char* end = nullptr;
+    long result = strtol(text.c_str(), &end, 10);
+    if (text.empty() || *end != '\0')
+    {
+        return false;
+    }
+    value = result;
+    return true;
+}
+
+// Parse a floating point option value. Returns false if it is not a number.
+bool parse_double(const string& text, double& value)
+{
+    char* end = nullptr;
+    double result = strtod(text.c_str(), &end);
+    if (text.empty() || *end != '\0')
+    {
+        return false;
+    }
+    value = result;
+    return true;
+}
+
+// Parse a shard written as "index/count", with 0 <= index < count
+bool parse_shard(const string& text, int& index, int& count)
+{
+    size_t slash = text.find('/');
+    int parsed_index;
+    int parsed_count;
+    if (slash == string::npos || !parse_int(text.substr(0, slash), parsed_index) ||
+        !parse_int(text.substr(slash + 1), parsed_count) || parsed_index < 0 || parsed_index >= parsed_count)
+    {
+        return false;
+    }
+    index = parsed_index;
+    count = parsed_count;
+    return true;
+}
+
+// Fill in the command line options. Returns false (after printing the problem) on bad input.
+bool parse_command_line(int argc, char* argv[], CommandLine& command_line)
+{
+    for (int i = 1; i < argc; i++)
+    {
+        string option = argv[i];
+        if (option == "--help" || option == "-h")
+        {
+            print_usage(argv[0]);
+            exit(0);
+        }
+
+        bool has_value = i + 1 < argc;
+        string value = has_value ? argv[i + 1] : "";
+        bool valid = true;
+
+        if (option == "--cache-hard-link")
+        {
+            command_line.cache.hard_link = true;
+            continue;
+        }
+        if (option == "--cache-stats")
+        {
+            command_line.cache_stats = true;
+            continue;
+        }
+        if (option == "--simd-info")
+        {
+            command_line.simd_info = true;
+            continue;
+        }
+        if (option == "--verify")
+        {
+            command_line.verify = true;
+            continue;
+        }
+        if (option == "--update-baseline")
+        {
+            command_line.update_baseline = true;
+            continue;
+        }
+        if (option == "--perf")
+        {
+            command_line.perf = true;
+            continue;
+        }
+        if (option == "--memory-report")
+        {
+            command_line.memory_report = true;
+            continue;
+        }
+        if (option == "--serve")
+        {
+            command_line.serve = true;
+            continue;
+        }
+
+        if (!has_value)
+        {
+            cerr << "Error: Missing value for " << option << "." << endl;
+            return false;
+        }
+        i++;
+
+        if (option == "--compare" || option == "--compare-dirs")
+        {
+            if (i + 1 >= argc)
+            {
+                cerr << "Error: " << option << " needs two paths." << endl;
+                return false;
+            }
+            command_line.compare_first = value;
+            command_line.compare_second = argv[++i];
+            command_line.compare_directories = option == "--compare-dirs";
+            continue;
+        }
+
+        if (option == "--input")
+        {
+            command_line.input_filename = value;
+        }
+        else if (option == "--output")
+        {
+            command_line.output_filename = value;
+        }
+        else if (option == "--process")
+        {
+            valid = parse_int(value, command_line.request.process);
+        }
+        else if (option == "--scaling-factor")
+        {
+            valid = parse_double(value, command_line.request.scaling_factor);
+        }
+        else if (option == "--number")
+        {
+            valid = parse_int(value, command_line.request.number);
+        }
+        else if (option == "--x-scale")
+        {
+            valid = parse_int(value, command_line.request.x_scale);
+        }
+        else if (option == "--y-scale")
+        {
+            valid = parse_int(value, command_line.request.y_scale);
+        }
+        else if (option == "--radius")
+        {
+            valid = parse_int(value, command_line.request.radius);
+        }
+        else if (option == "--sigma")
+        {
+            valid = parse_double(value, command_line.request.sigma);
+        }
+        else if (option == "--amount")
+        {
+            valid = parse_double(value, command_line.request.amount);
+        }
+        else if (option == "--scale")
+        {
+            valid = parse_double(value, command_line.request.scale);
+        }
+        else if (option == "--size")
+        {
+            valid = parse_size(value, command_line.request.target_width, command_line.request.target_height);
+        }
+        else if (option == "--interpolation")
+        {
+            valid = parse_interpolation(value, command_line.request.interpolation);
+        }
+        else if (option == "--angle")
+        {
+            valid = parse_double(value, command_line.request.angle);
+        }
+        else if (option == "--background")
+        {
+            valid = parse_color(value, command_line.request.background);
+        }
+        else if (option == "--crop")
+        {
+            valid = parse_region(value, command_line.request.crop);
+        }
+        else if (option == "--roi")
+        {
+            valid = parse_region(value, command_line.request.roi);
+        }
+        else if (option == "--output-format")
+        {
+            command_line.output_format = value;
+            valid = value == "bmp" || value == "qoi";
+        }
+        else if (option == "--max-memory")
+        {
+            valid = parse_int(value, command_line.max_memory_mb) && command_line.max_memory_mb > 0;
+        }
+        else if (option == "--cache-dir")
+        {
+            command_line.cache.directory = value;
+        }
+        else if (option == "--socket")
+        {
+            command_line.serve = true;
+            command_line.socket_path = value;
+        }
+        else if (option == "--workers")
+        {
+            valid = parse_int(value, command_line.workers) && command_line.workers > 0;
+        }
+        else if (option == "--image-cache")
+        {
+            valid = parse_int(value, command_line.image_cache_size) && command_line.image_cache_size > 0;
+        }
+        else if (option == "--huge-pages")
+        {
+            valid = value == "transparent" || value == "explicit";
+            command_line.huge_pages = value;
+        }
+        else if (option == "--batch")
+        {
+            command_line.batch_filename = value;
+        }
+        else if (option == "--shard")
+        {
+            valid = parse_shard(value, command_line.shard_index, command_line.shard_count);
+        }
+        else if (option == "--shard-by")
+        {
+            valid = value == "index" || value == "hash";
+            command_line.shard_by_hash = value == "hash";
+        }
+        else if (option == "--batch-log")
+        {
+            command_line.batch_log_filename = value;
+        }
+        else if (option == "--stats")
+        {
+            command_line.stats_filename = value;
+        }
+        else if (option == "--codec-bench")
+        {
+            command_line.codec_bench_filename = value;
+        }
+        else if (option == "--diff-image")
+        {
+            command_line.diff_image_filename = value;
+        }
+        else if (option == "--max-error")
+        {
+            valid = parse_int(value, command_line.max_error) && command_line.max_error >= 0;
+        }
+        else if (option == "--min-psnr")
+        {
+            valid = parse_double(value, command_line.min_psnr);
+        }
+        else if (option == "--max-mismatches")
+        {
+            int mismatches = 0;
+            valid = parse_int(value, mismatches) && mismatches >= 0;
+            command_line.max_mismatches = mismatches;
+        }
+        else if (option == "--golden-dir")
+        {
+            command_line.golden_directory = value;
+        }
+        else if (option == "--baseline")
+        {
+            command_line.baseline_filename = value;
+        }
+        else if (option == "--max-slowdown")
+        {
+            valid = parse_double(value, command_line.max_slowdown) && command_line.max_slowdown >= 0;
+        }
+        else if (option == "--repeat")
+        {
+            valid = parse_int(value, command_line.repeat) && command_line.repeat > 0;
+        }
+        else if (option == "--cache-max-mb")
+        {
+            int megabytes = 0;
+            valid = parse_int(value, megabytes) && megabytes > 0;
+            command_line.cache.max_bytes = megabytes * 1024LL * 1024;
+        }
+        else
+        {
+            cerr << "Error: Unknown option " << option << "." << endl;
+            return false;
+        }
+
+        if (!valid)
+        {
+            cerr << "Error: Invalid value for " << option << ": " << value << "." << endl;
+            return false;
+        }
+    }
+
+    if (!command_line.cache.directory.empty())
+    {
+        error_code ec;
+        filesystem::create_directories(command_line.cache.directory, ec);
+        if (!filesystem::is_directory(command_line.cache.directory, ec))
+        {
+            cerr << "Error: Cannot use cache directory " << command_line.cache.directory << "." << endl;
+            return false;
+        }
+    }
+    return true;
+}
+
+// Hardware counters for pipeline stages, from perf_event_open on Linux. The counters run for
+// the life of the object and follow every thread started after it; a stage is the change
+// between two reads. Counters the CPU, kernel or container does not allow are left out.
+class PerfCounters
+{
+public:
+    static const int EVENTS = 6;    // cycles, instructions, LLC misses, dTLB misses, branch misses, page faults
+
+    PerfCounters()
+    {
+        for (int i = 0; i < EVENTS; i++)
+        {
+            fds[i] = -1;
+        }
+#ifdef __linux__
+        const uint32_t types[EVENTS] = {PERF_TYPE_HARDWARE, PERF_TYPE_HARDWARE, PERF_TYPE_HW_CACHE, PERF_TYPE_HW_CACHE,
+                                        PERF_TYPE_HARDWARE, PERF_TYPE_SOFTWARE};
+        const uint64_t configs[EVENTS] = {
+            PERF_COUNT_HW_CPU_CYCLES,
+            PERF_COUNT_HW_INSTRUCTIONS,
+            PERF_COUNT_HW_CACHE_LL | PERF_COUNT_HW_CACHE_OP_READ << 8 | PERF_COUNT_HW_CACHE_RESULT_MISS << 16,
+            PERF_COUNT_HW_CACHE_DTLB | PERF_COUNT_HW_CACHE_OP_READ << 8 | PERF_COUNT_HW_CACHE_RESULT_MISS << 16,
+            PERF_COUNT_HW_BRANCH_MISSES,
+            PERF_COUNT_SW_PAGE_FAULTS};
+        for (int i = 0; i < EVENTS; i++)
+        {
+            perf_event_attr attr = {};
+            attr.size = sizeof(attr);
+            attr.type = types[i];
+            attr.config = configs[i];
+            attr.inherit = 1;
+            attr.exclude_kernel = 1;
+            attr.exclude_hv = 1;
+            attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+            fds[i] = syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+            if (fds[i] < 0 && error.empty())
+            {
+                error = strerror(errno);
+            }
+            opened = opened + (fds[i] >= 0);
+        }
+#else
+        error = "not supported on this system";
+#endif
+        begin();
+    }
+
+    ~PerfCounters()
+    {
+#ifdef __linux__
+        for (int i = 0; i < EVENTS; i++)
+        {
+            if (fds[i] >= 0)
+            {
+                close(fds[i]);
+            }
+        }
+#endif
+    }
+
+    // Why some counters could not be opened, or empty if all were
+    string unavailable_reason() const
+    {
+        return error;
+    }
+
+    // Whether any counter is running
+    bool any_available() const
+    {
+        return opened > 0;
+    }
+
+    // Start a stage
+    void begin()
+    {
+        read_all(start);
+        start_time = chrono::steady_clock::now();
+    }
+
+    // Column titles for end()
+    static string header()
+    {
+        ostringstream out;
+        out << left << setw(12) << "stage" << right << setw(10) << "ms" << setw(11) << "cycles/px" << setw(7) << "IPC"
+            << setw(13) << "LLC miss/px" << setw(14) << "dTLB miss/px" << setw(16) << "branch miss/px"
+            << setw(12) << "faults/Mpx" << setw(8) << "Mpx/s";
+        return out.str();
+    }
+
+    // Finish a stage over the given number of pixels, format its line and start the next stage
+    string end(const string& stage, long long pixels)
+    {
+        double elapsed = chrono::duration<double, milli>(chrono::steady_clock::now() - start_time).count();
+        double finish[EVENTS];
+        read_all(finish);
+        double counts[EVENTS];
+        for (int i = 0; i < EVENTS; i++)
+        {
+            counts[i] = start[i] < 0 || finish[i] < 0 ? -1.0 : finish[i] - start[i];
+        }
+
+        ostringstream out;
+        out << left << setw(12) << stage << right << fixed << setprecision(2) << setw(10) << elapsed;
+        auto column = [&](double value, int width, int precision)
+        {
+            if (value < 0)
+            {
+                out << setw(width) << "-";
+            }
+            else
+            {
+                out << setw(width) << setprecision(precision) << value;
+            }
+        };
+        double per_pixel = pixels > 0 ? 1.0 / pixels : 0.0;
+        column(counts[0] < 0 ? -1.0 : counts[0] * per_pixel, 11, 2);
+        column(counts[0] <= 0 || counts[1] < 0 ? -1.0 : counts[1] / counts[0], 7, 2);
+        column(counts[2] < 0 ? -1.0 : counts[2] * per_pixel, 13, 4);
+        column(counts[3] < 0 ? -1.0 : counts[3] * per_pixel, 14, 4);
+        column(counts[4] < 0 ? -1.0 : counts[4] * per_pixel, 16, 4);
+        column(counts[5] < 0 ? -1.0 : counts[5] * per_pixel * 1e6, 12, 1);
+        column(elapsed > 0 ? pixels / elapsed / 1000.0 : -1.0, 8, 1);
+        begin();
+        return out.str();
+    }
+
+private:
+    // Current value of every counter, scaled up when the kernel had to multiplex it, or -1
+    void read_all(double values[EVENTS])
+    {
+        for (int i = 0; i < EVENTS; i++)
+        {
+            values[i] = -1.0;
+#ifdef __linux__
+            uint64_t data[3];
+            if (fds[i] >= 0 && read(fds[i], data, sizeof(data)) == sizeof(data) && data[2] > 0)
+            {
+                values[i] = (double)data[0] * data[1] / data[2];
+            }
+#endif
+        }
+    }
+
+    int fds[EVENTS];
+    int opened = 0;
+    string error;
+    double start[EVENTS];
+    chrono::steady_clock::time_point start_time;
+};
+
+// Print the counter columns, or why there are none
+void print_perf_header(const PerfCounters& counters)
+{
+    if (!counters.any_available())
+    {
+        clog << "Note: Hardware counters are unavailable (" << counters.unavailable_reason()
+             << "), so only times are shown. Containers and VMs often lack a PMU or need perf_event_paranoid <= 2." << endl;
+    }
+    else if (!counters.unavailable_reason().empty())
+    {
+        clog << "Note: Some hardware counters are unavailable (" << counters.unavailable_reason() << "); they show as -." << endl;
+    }
+    clog << PerfCounters::header() << endl;
+}
+
+// Copy the input to the output, then run the process on the region of interest and write
+// it back in place
+bool patch_region(const string& input_filename, const string& output_filename, const ProcessRequest& request)
+{
+    Region region = request.roi;
+    vector<vector<Pixel>> image = read_image_region(input_filename, region);
+    if (image.empty())
+    {
+        cerr << "Error: Could not read " << input_filename << " as a BMP image or the region lies outside it." << endl;
+        return false;
+    }
+
+    error_code error;
+    filesystem::copy_file(input_filename, output_filename, filesystem::copy_options::overwrite_existing, error);
+    if (error)
+    {
+        cerr << "Error: Could not copy " << input_filename << " to " << output_filename << "." << endl;
+        return false;
+    }
+
+    ProcessRequest inner = request;
+    inner.roi = Region();
+    if (!write_image_region(output_filename, region, apply_process(move(image), inner)))
+    {
+        cerr << "Error: Failed to save the processed image to " << output_filename << "." << endl;
+        return false;
+    }
+    return true;
+}
+
+// Run a single process without the menu. Returns the process exit code.
+int run_command_line(const CommandLine& command_line)
+{
+    // "-" reads standard input or writes standard output front to back, without seeking
+    bool from_stdin = command_line.input_filename == "-";
+    bool to_stdout = command_line.output_filename == "-";
+    if (from_stdin || to_stdout)
+    {
+        ios::sync_with_stdio(false);
+    }
+
+    if (command_line.output_filename.empty())
+    {
+        cerr << "Error: --output is required with --input." << endl;
+        return 1;
+    }
+    if (command_line.output_filename == command_line.input_filename && !from_stdin)
+    {
+        cerr << "Error: Output filename cannot be the same as the input filename." << endl;
+        return 1;
+    }
+    string error = request_error(command_line.request);
+    if (!error.empty())
+    {
+        cerr << "Error: " << error << endl;
+        return 1;
+    }
+
+    // On a cache hit the input is never decoded. Pipes are never cached.
+    string key;
+    if (!command_line.cache.directory.empty() && !from_stdin && !to_stdout)
+    {
+        key = cache_key(command_line.input_filename, command_line.request, command_line.output_filename);
+        if (fetch_cached_result(command_line.cache, key, command_line.output_filename))
+        {
+            return 0;
+        }
+    }
+    if (!to_stdout)
+    {
+        detach_output(command_line.output_filename);
+    }
+
+    // Steps report their peak resident memory with --max-memory or --memory-report, and
+    // their hardware counters with --perf
+    bool report = command_line.max_memory_mb > 0 || command_line.memory_report;
+    if (report)
+    {
+        reset_peak_memory();
+    }
+    unique_ptr<PerfCounters> counters;
+    if (command_line.perf)
+    {
+        counters = make_unique<PerfCounters>();
+        print_perf_header(*counters);
+    }
+    auto finish_step = [&](const string& step, long long pixels)
+    {
+        if (report)
+        {
+            report_peak_memory(step);
+        }
+        if (counters)
+        {
+            clog << counters->end(step, pixels) << endl;
+        }
+    };
+
+    // A region of interest on a full BMP image is patched into a copy of the input, so only
+    // the region's scanlines are decoded, processed and rewritten
+    ProcessRequest request = command_line.request;
+    bool qoi_output = to_stdout ? command_line.output_format == "qoi" : is_qoi_filename(command_line.output_filename);
+    if (!request.roi.empty() && request.crop.empty() && !from_stdin && !to_stdout &&
+        !is_qoi_filename(command_line.input_filename) && !qoi_output)
+    {
+        if (!patch_region(command_line.input_filename, command_line.output_filename, request))
+        {
+            return 1;
+        }
+        finish_step("region", (long long)request.roi.width * request.roi.height);
+        store_cached_result(command_line.cache, key, command_line.output_filename);
+        return 0;
+    }
+
+    // Read the header first so the memory plan knows the size. A QOI input is read whole;
+    // standard input is QOI if it starts like one.
+    ifstream file;
+    if (!from_stdin)
+    {
+        file.open(command_line.input_filename, ios::binary);
+    }
+    istream& input = from_stdin ? cin : file;
+    bool qoi_input = from_stdin ? input.peek() == 'q' : is_qoi_filename(command_line.input_filename);
+    BmpInfo info;
+    string qoi_data;
+    Region source = request.crop;
+    bool readable;
+    if (qoi_input)
+    {
+        qoi_data = read_stream(input);
+        readable = read_qoi_size((const unsigned char*)qoi_data.data(), qoi_data.size(), qoi_data.size(), info.width, info.height);
+    }
+    else
+    {
+        readable = read_bmp_info(input, info);
+    }
+    if (source.empty())
+    {
+        source = {0, 0, info.width, info.height};
+    }
+    if (!readable || !clip_region(source, info.width, info.height))
+    {
+        cerr << "Error: Could not read " << command_line.input_filename << " as an image"
+             << (request.crop.empty() ? "." : " or the crop lies outside it.") << endl;
+        return 1;
+    }
+    request.crop = Region();
+
+    // Within a memory budget, choose the thread count and in-memory or streaming
+    if (command_line.max_memory_mb > 0)
+    {
+        long long available = command_line.max_memory_mb * 1048576LL - resident_memory("VmRSS:");
+        MemoryPlan plan = plan_memory(request, source.width, source.height, available, true);
+        if (plan.streaming && (qoi_input || qoi_output || (from_stdin && !streams_forward(request))))
+        {
+            plan.streaming = false;
+            plan.estimate = process_memory(request, source.width, source.height, plan.threads);
+        }
+        worker_thread_limit = plan.threads;
+        clog << "memory budget " << command_line.max_memory_mb << " MB: "
+             << (plan.streaming ? "streaming " + to_string(plan.strip_rows) + " rows per strip" : string("in memory"))
+             << ", " << plan.threads << " threads, estimated " << fixed << setprecision(1)
+             << plan.estimate / 1048576.0 << " MB" << defaultfloat << endl;
+        if (plan.estimate > available)
+        {
+            clog << "Warning: The budget is too small for this request; it needs about "
+                 << (command_line.max_memory_mb * 1048576LL - available + plan.estimate) / 1048576 << " MB." << endl;
+        }
+
+        if (plan.streaming)
+        {
+            ProcessRequest cropped = request;
+            if (source.width != info.width || source.height != info.height)
+            {
+                cropped.crop = source;
+            }
+            ofstream output_file;
+            if (!to_stdout)
+            {
+                output_file.open(command_line.output_filename, ios::binary);
+            }
+            ostream& output = to_stdout ? cout : output_file;
+            if (!output || !stream_process(input, info, !from_stdin, output, cropped, plan.strip_rows) || !output.flush())
+            {
+                cerr << "Error: Failed to stream " << command_line.input_filename << " to " << command_line.output_filename << "." << endl;
+                return 1;
+            }
+            finish_step("stream", (long long)source.width * source.height);
+            store_cached_result(command_line.cache, key, command_line.output_filename);
+            return 0;
+        }
+    }
+
+    // A crop of a BMP is applied while decoding; whole BMP files are decoded in parallel
+    vector<vector<Pixel>> image;
+    if (qoi_input)
+    {
+        image = decode_qoi((const unsigned char*)qoi_data.data(), qoi_data.size());
+        string().swap(qoi_data);
+        if (!image.empty() && (source.width != info.width || source.height != info.height))
+        {
+            image = crop_image(image, source);
+        }
+    }
+    else if (!from_stdin && source.width == info.width && source.height == info.height)
+    {
+        image = read_image_fast(command_line.input_filename);
+    }
+    else
+    {
+        image = BmpRowSource(input, info, !from_stdin).read(source);
+    }
+    if (image.empty())
+    {
+        cerr << "Error: Could not read " << command_line.input_filename << " as an image." << endl;
+        return 1;
+    }
+    finish_step("decode", (long long)source.width * source.height);
+
+    // The input is not needed once processed, so processes that keep the pixel layout
+    // overwrite it; for the others it is freed before encoding
+    vector<vector<Pixel>> new_image = apply_process(move(image), request);
+    vector<vector<Pixel>>().swap(image);
+    finish_step("process", (long long)source.width * source.height);
+
+    bool written;
+    if (to_stdout)
+    {
+        written = (qoi_output ? write_qoi(cout, new_image) : write_image_fast(cout, new_image)) && cout.flush();
+    }
+    else
+    {
+        written = write_image_fast(command_line.output_filename, new_image);
+    }
+    if (!written)
+    {
+        cerr << "Error: Failed to save the processed image to " << command_line.output_filename << "." << endl;
+        return 1;
+    }
+    finish_step("encode", (long long)new_image.size() * new_image[0].size());
+    store_cached_result(command_line.cache, key, command_line.output_filename);
+    return 0;
+}
+
+// Compare two images of the same size, one row band per thread
+DiffStats compare_images(const vector<vector<Pixel>>& first, const vector<vector<Pixel>>& second)
+{
+    int height = first.size();
+    int width = first[0].size();
+    vector<DiffStats> band_stats(worker_thread_count());
+    const PixelKernels& kernels = pixel_kernels();
+
+    int bands = parallel_for_rows(height, [&](int band, int begin, int end)
+    {
+        for (int row = begin; row < end; row++)
+        {
+            kernels.compare(first[row].data(), second[row].data(), width, band_stats[band]);
+        }
+    });
+
+    DiffStats total;
+    for (int band = 0; band < bands; band++)
+    {
+        total.max_error = max(total.max_error, band_stats[band].max_error);
+        total.mismatches = total.mismatches + band_stats[band].mismatches;
+        total.squared_error = total.squared_error + band_stats[band].squared_error;
+    }
+    return total;
+}
+
+// Peak signal-to-noise ratio in dB (infinite for identical images)
+double psnr(const DiffStats& stats, long long pixels)
+{
+    if (stats.squared_error == 0)
+    {
+        return INFINITY;
+    }
+    double mean_squared_error = (double)stats.squared_error / (pixels * 3);
+    return 10.0 * log10(255.0 * 255.0 / mean_squared_error);
+}
+
+// Heatmap of the differences: matching pixels show the first image dimmed,
+// differing pixels run from dark red to yellow as the error approaches the maximum
+vector<vector<Pixel>> difference_heatmap(const vector<vector<Pixel>>& first, const vector<vector<Pixel>>& second, int max_error)
+{
+    int height = first.size();
+    int width = first[0].size();
+    vector<vector<Pixel>> heatmap = make_image(height, width);
+
+    parallel_for_rows(height, [&](int, int begin, int end)
+    {
+        for (int row = begin; row < end; row++)
+        {
+            for (int col = 0; col < width; col++)
+            {
+                const Pixel& a = first[row][col];
+                const Pixel& b = second[row][col];
+                int error = max(abs(a.red - b.red), max(abs(a.green - b.green), abs(a.blue - b.blue)));
+                if (error == 0)
+                {
+                    int gray = (a.red + a.green + a.blue) / 12;
+                    heatmap[row][col] = {gray, gray, gray};
+                }
+                else
+                {
+                    int level = 64 + 191 * error / max(1, max_error);
+                    heatmap[row][col] = {min(255, 2 * level), max(0, 2 * level - 255), 0};
+                }
+            }
+        }
+    });
+    return heatmap;
+}
+
+// Compare one pair of images and print one result line. Returns true when within tolerance.
+bool compare_pair(const CommandLine& command_line, const string& first_filename, const string& second_filename, const string& label)
+{
+    vector<vector<Pixel>> first = read_image_fast(first_filename);
+    vector<vector<Pixel>> second = read_image_fast(second_filename);
+    if (first.empty() || second.empty())
+    {
+        cout << label << ": cannot read " << (first.empty() ? first_filename : second_filename) << " as an image" << endl;
+        return false;
+    }
+    if (first.size() != second.size() || first[0].size() != second[0].size())
+    {
+        cout << label << ": size differs (" << first[0].size() << "x" << first.size() << " vs "
+             << second[0].size() << "x" << second.size() << ")" << endl;
+        return false;
+    }
+
+    DiffStats stats = compare_images(first, second);
+    long long pixels = (long long)first.size() * first[0].size();
+    double quality = psnr(stats, pixels);
+    bool passed = stats.max_error <= command_line.max_error &&
+                  (command_line.min_psnr <= 0.0 || quality >= command_line.min_psnr) &&
+                  (command_line.max_mismatches < 0 || stats.mismatches <= command_line.max_mismatches);
+
+    cout << label << ": max error " << stats.max_error << ", mismatched pixels " << stats.mismatches << " of " << pixels
+         << " (" << fixed << setprecision(3) << 100.0 * stats.mismatches / pixels << "%), PSNR ";
+    if (isinf(quality))
+    {
+        cout << "inf";
+    }
+    else
+    {
+        cout << setprecision(2) << quality << " dB";
+    }
+    cout << defaultfloat << (passed ? "" : "  FAIL") << endl;
+
+    if (!command_line.diff_image_filename.empty() && !command_line.compare_directories)
+    {
+        if (!write_image_fast(command_line.diff_image_filename, difference_heatmap(first, second, stats.max_error)))
+        {
+            cerr << "Error: Failed to save the heatmap to " << command_line.diff_image_filename << "." << endl;
+        }
+    }
+    return passed;
+}
+
+// Compare two images, or every .bmp of one directory with its namesake in another.
+// Returns the process exit code: nonzero if any pair is outside the tolerance.
+int run_compare(const CommandLine& command_line)
+{
+    if (!command_line.compare_directories)
+    {
+        return compare_pair(command_line, command_line.compare_first, command_line.compare_second, "compare") ? 0 : 1;
+    }
+
+    vector<filesystem::path> names;
+    error_code ec;
+    for (const filesystem::directory_entry& entry : filesystem::directory_iterator(command_line.compare_first, ec))
+    {
+        if (entry.is_regular_file() && (entry.path().extension() == ".bmp" || is_qoi_filename(entry.path().string())))
+        {
+            names.push_back(entry.path().filename());
+        }
+    }
+    if (ec)
+    {
+        cerr << "Error: Cannot read directory " << command_line.compare_first << "." << endl;
+        return 1;
+    }
+    sort(names.begin(), names.end());
+
+    int failures = 0;
+    for (const filesystem::path& name : names)
+    {
+        filesystem::path first = filesystem::path(command_line.compare_first) / name;
+        filesystem::path second = filesystem::path(command_line.compare_second) / name;
+        if (!filesystem::exists(second, ec))
+        {
+            cout << name.string() << ": missing from " << command_line.compare_second << endl;
+            failures++;
+        }
+        else if (!compare_pair(command_line, first.string(), second.string(), name.string()))
+        {
+            failures++;
+        }
+    }
+    cout << names.size() - failures << " of " << names.size() << " images within tolerance" << endl;
+    return failures == 0 ? 0 : 1;
+}
+
+// Encode and decode an image in memory as BMP and as QOI and print the sizes and speeds
+// (megapixels per second, best of --repeat runs). Both must give the image back unchanged.
+int run_codec_benchmark(const CommandLine& command_line)
+{
+    vector<vector<Pixel>> image = read_image_fast(command_line.codec_bench_filename);
+    if (image.empty())
+    {
+        cerr << "Error: Could not read " << command_line.codec_bench_filename << "." << endl;
+        return 1;
+    }
+    double megapixels = (double)image.size() * image[0].size() / 1e6;
+    int repeat = max(1, command_line.repeat);
+
+    cout << left << setw(6) << "codec" << right << setw(14) << "bytes" << setw(10) << "of BMP"
+         << setw(14) << "encode MP/s" << setw(14) << "decode MP/s" << endl;
+    size_t bmp_bytes = 0;
+    for (string codec : {"bmp", "qoi"})
+    {
+        bool qoi = codec == "qoi";
+        string encoded;
+        double encode_ms = 1e300;
+        double decode_ms = 1e300;
+        for (int run = 0; run < repeat; run++)
+        {
+            ostringstream out;
+            chrono::steady_clock::time_point start = chrono::steady_clock::now();
+            bool written = qoi ? write_qoi(out, image) : write_image_fast(out, image);
+            encode_ms = min(encode_ms, chrono::duration<double, milli>(chrono::steady_clock::now() - start).count());
+            encoded = out.str();
+
+            istringstream in(encoded);
+            start = chrono::steady_clock::now();
+            vector<vector<Pixel>> decoded = qoi ? read_qoi(in) : read_image_fast(in);
+            decode_ms = min(decode_ms, chrono::duration<double, milli>(chrono::steady_clock::now() - start).count());
+
+            if (!written || decoded.size() != image.size() || decoded[0].size() != image[0].size() ||
+                compare_images(image, decoded).mismatches != 0)
+            {
+                cerr << "Error: " << codec << " did not give the image back unchanged." << endl;
+                return 1;
+            }
+        }
+        if (!qoi)
+        {
+            bmp_bytes = encoded.size();
+        }
+        cout << left << setw(6) << codec << right << setw(14) << encoded.size() << fixed << setprecision(1)
+             << setw(9) << 100.0 * encoded.size() / bmp_bytes << "%" << setw(14) << megapixels / (encode_ms / 1000.0)
+             << setw(14) << megapixels / (decode_ms / 1000.0) << defaultfloat << endl;
+    }
+    return 0;
+}
 
-    string selection;
-    cin >> selection;
+// Run every process on the golden sample with the parameters its reference image was made with,
+// compare the encoded output byte for byte and check the timings against a stored baseline.
+// Returns the process exit code: nonzero on any mismatch or regression.
+int run_verify(const CommandLine& command_line)
+{
+    struct GoldenCase
+    {
+        string name;
+        ProcessRequest request;
+    };
+    vector<GoldenCase> cases;
+    for (int process = 1; process <= 10; process++)
+    {
+        GoldenCase golden;
+        golden.name = "process" + to_string(process);
+        golden.request.process = process;
+        cases.push_back(golden);
+    }
+    cases[1].request.scaling_factor = 0.3;
+    cases[4].request.number = 2;
+    cases[5].request.x_scale = 2;
+    cases[5].request.y_scale = 3;
+    cases[7].request.scaling_factor = 0.5;
+    cases[8].request.scaling_factor = 0.5;
+
+    filesystem::path directory = command_line.golden_directory;
+    vector<vector<Pixel>> sample = read_image_fast((directory / "sample.bmp").string());
+    if (sample.empty())
+    {
+        cerr << "Error: Could not read " << (directory / "sample.bmp").string() << "." << endl;
+        return 1;
+    }
 
-    return selection;
+    map<string, double> baseline;
+    if (!command_line.baseline_filename.empty())
+    {
+        ifstream in(command_line.baseline_filename);
+        string name;
+        double milliseconds;
+        while (in >> name >> milliseconds)
+        {
+            baseline[name] = milliseconds;
+        }
+    }
+
+    // One more run of every case under the hardware counters with --perf
+    unique_ptr<PerfCounters> counters;
+    vector<string> perf_lines;
+    if (command_line.perf)
+    {
+        counters = make_unique<PerfCounters>();
+    }
+
+    // Differences under a millisecond are timer noise on the small sample
+    const double NOISE_MS = 1.0;
+    bool passed = true;
+    map<string, double> timings;
+    cout << left << setw(12) << "Case" << setw(22) << "Output" << right << setw(12) << "Best ms" << setw(14) << "Baseline ms" << endl;
+
+    for (const GoldenCase& golden : cases)
+    {
+        vector<vector<Pixel>> result;
+        double best = 0.0;
+        for (int run = 0; run < command_line.repeat; run++)
+        {
+            chrono::steady_clock::time_point start = chrono::steady_clock::now();
+            result = apply_process(sample, golden.request);
+            double elapsed = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+            best = run == 0 ? elapsed : min(best, elapsed);
+        }
+        timings[golden.name] = best;
+        if (counters)
+        {
+            counters->begin();
+            apply_process(sample, golden.request);
+            perf_lines.push_back(counters->end(golden.name, (long long)sample.size() * sample[0].size()));
+        }
+
+        ostringstream encoded;
+        write_image_fast(encoded, result);
+        string actual = encoded.str();
+        ifstream reference_stream(directory / (golden.name + ".bmp"), ios::binary);
+        string expected((istreambuf_iterator<char>(reference_stream)), istreambuf_iterator<char>());
+
+        string status = "match";
+        if (expected.empty())
+        {
+            status = "no reference";
+            passed = false;
+        }
+        else if (actual != expected)
+        {
+            long long differing = 0;
+            for (size_t i = 0; i < min(actual.size(), expected.size()); i++)
+            {
+                differing = differing + (actual[i] != expected[i]);
+            }
+            differing = differing + max(actual.size(), expected.size()) - min(actual.size(), expected.size());
+            status = "MISMATCH " + to_string(differing) + " bytes";
+            passed = false;
+        }
+
+        cout << left << setw(12) << golden.name << setw(22) << status << right << fixed << setprecision(3) << setw(12) << best;
+        if (baseline.count(golden.name))
+        {
+            double allowed = baseline[golden.name] * (1.0 + command_line.max_slowdown / 100.0) + NOISE_MS;
+            cout << setw(14) << baseline[golden.name];
+            if (best > allowed && !command_line.update_baseline)
+            {
+                cout << "  REGRESSION";
+                passed = false;
+            }
+        }
+        cout << defaultfloat << endl;
+    }
+
+    if (counters)
+    {
+        print_perf_header(*counters);
+        for (const string& line : perf_lines)
+        {
+            clog << line << endl;
+        }
+    }
+
+    if (command_line.update_baseline)
+    {
+        if (command_line.baseline_filename.empty())
+        {
+            cerr << "Error: --update-baseline needs --baseline FILE." << endl;
+            return 1;
+        }
+        ofstream out(command_line.baseline_filename, ios::trunc);
+        out << fixed << setprecision(3);
+        for (const auto& [name, milliseconds] : timings)
+        {
+            out << name << " " << milliseconds << endl;
+        }
+        cout << "Saved timings to " << command_line.baseline_filename << endl;
+    }
+
+    cout << (passed ? "PASSED" : "FAILED") << endl;
+    return passed ? 0 : 1;
 }
 
-// Verify filename is .bmp
-string get_valid_filename(string prompt)
+// A value from a flat JSON object, kept as text
+struct JsonValue
 {
-    string filename;
-    while (true)
+    string text;
+    bool is_string = false;
+};
+
+// Parse a flat JSON object of strings, numbers, booleans and nulls. Returns false on anything else.
+bool parse_json_object(const string& line, map<string, JsonValue>& fields)
+{
+    int i = 0;
+    int n = line.size();
+    auto skip_spaces = [&]()
     {
-        cout << prompt;
-        cin >> filename;
-        if (filename == "Q" || filename == "q")
+        while (i < n && isspace((unsigned char)line[i])) i++;
+    };
+    auto parse_string = [&](string& out)
+    {
+        if (i >= n || line[i] != '"') return false;
+        i++;
+        while (i < n && line[i] != '"')
         {
-            cout << endl;
-            cout << "Thank you for using my program....Goodbye!" << endl;
-            cout << endl;
-            exit(0);
+            char c = line[i++];
+            if (c != '\\')
+            {
+                out += c;
+                continue;
+            }
+            if (i >= n) return false;
+            char escape = line[i++];
+            switch (escape)
+            {
+                case 'n': out += '\n'; break;
+                case 't': out += '\t'; break;
+                case 'r': out += '\r'; break;
+                case 'b': out += '\b'; break;
+                case 'f': out += '\f'; break;
+                case 'u':
+                {
+                    if (i + 4 > n) return false;
+                    int code = 0;
+                    for (int end = i + 4; i < end; i++)
+                    {
+                        char digit = line[i];
+                        if (!isxdigit((unsigned char)digit)) return false;
+                        code = code * 16 + (isdigit((unsigned char)digit) ? digit - '0' : tolower(digit) - 'a' + 10);
+                    }
+                    // Only single byte characters are expected in paths and ids
+                    out += code < 0x80 ? (char)code : '?';
+                    break;
+                }
+                default: out += escape; break;
+            }
         }
+        if (i >= n) return false;
+        i++;
+        return true;
+    };
+
+    skip_spaces();
+    if (i >= n || line[i] != '{') return false;
+    i++;
+    skip_spaces();
+    if (i < n && line[i] == '}') return true;
+
+    while (i < n)
+    {
+        skip_spaces();
+        string name;
+        if (!parse_string(name)) return false;
+        skip_spaces();
+        if (i >= n || line[i] != ':') return false;
+        i++;
+        skip_spaces();
+
+        JsonValue value;
+        if (i < n && line[i] == '"')
+        {
+            value.is_string = true;
+            if (!parse_string(value.text)) return false;
+        }
+        else
+        {
+            while (i < n && line[i] != ',' && line[i] != '}' && !isspace((unsigned char)line[i]))
+            {
+                value.text += line[i++];
+            }
+            if (value.text.empty()) return false;
+        }
+        fields[name] = value;
 
-        if (filename.length() >= 4 && filename.substr(filename.length() - 4) == ".bmp")
+        skip_spaces();
+        if (i < n && line[i] == ',')
         {
-            return filename;
+            i++;
+            continue;
         }
-        cout << endl;
-        cout << "Error: Input file must be a .bmp file." << endl;
-        cout << endl;
+        return i < n && line[i] == '}';
     }
+    return false;
 }
 
-// Verify output filename is .bmp, and not the same as input filename or an already saved output filename
-string get_output_filename(string input_filename, vector<string> existing_outputs, string prompt)
+// Quote a string for JSON output
+string json_quote(const string& text)
 {
-    string output_filename;
+    string out = "\"";
+    for (char c : text)
+    {
+        if (c == '"' || c == '\\')
+        {
+            out += '\\';
+            out += c;
+        }
+        else if (c == '\n')
+        {
+            out += "\\n";
+        }
+        else if ((unsigned char)c < 0x20)
+        {
+            char code[8];
+            snprintf(code, sizeof(code), "\\u%04x", c);
+            out += code;
+        }
+        else
+        {
+            out += c;
+        }
+    }
+    return out + "\"";
+}
+
+// Decoded images kept in memory between server requests, dropping the least recently used
+class ImageCache
+{
+public:
+    explicit ImageCache(int capacity) : capacity(capacity) {}
+
+    // Get the decoded image for a file, decoding it on a miss. Returns null if it cannot be read.
+    shared_ptr<const vector<vector<Pixel>>> get(const string& filename, bool& was_cached)
+    {
+        // A changed file gets a new version and is decoded again
+        error_code ec;
+        if (!filesystem::is_regular_file(filename, ec))
+        {
+            return nullptr;
+        }
+        string version = to_string(filesystem::last_write_time(filename, ec).time_since_epoch().count()) + ":" +
+                         to_string(filesystem::file_size(filename, ec));
+
+        {
+            lock_guard<mutex> lock(guard);
+            auto found = entries.find(filename);
+            if (found != entries.end() && found->second.version == version)
+            {
+                recency.splice(recency.begin(), recency, found->second.position);
+                was_cached = true;
+                return found->second.image;
+            }
+        }
+
+        // Decode outside the lock so other requests keep being served
+        was_cached = false;
+        shared_ptr<const vector<vector<Pixel>>> image = make_shared<const vector<vector<Pixel>>>(read_image_fast(filename));
+        if (image->empty())
+        {
+            return nullptr;
+        }
+
+        lock_guard<mutex> lock(guard);
+        auto found = entries.find(filename);
+        if (found != entries.end())
+        {
+            recency.erase(found->second.position);
+            entries.erase(found);
+        }
+        recency.push_front(filename);
+        entries[filename] = {version, image, recency.begin()};
+        while ((int)entries.size() > capacity)
+        {
+            entries.erase(recency.back());
+            recency.pop_back();
+        }
+        return image;
+    }
+
+private:
+    struct Entry
+    {
+        string version;
+        shared_ptr<const vector<vector<Pixel>>> image;
+        list<string>::iterator position;
+    };
+
+    int capacity;
+    mutex guard;
+    list<string> recency;
+    unordered_map<string, Entry> entries;
+};
+
+// Fixed set of threads running queued tasks. Destroying the pool finishes every queued task first.
+class WorkerPool
+{
+public:
+    // Tasks run with at most threads_per_task row-parallel threads each, so count busy workers
+    // do not start count times a full set of threads
+    WorkerPool(int count, int threads_per_task) : threads_per_task(threads_per_task)
+    {
+        for (int i = 0; i < count; i++)
+        {
+            threads.emplace_back([this] { run(); });
+        }
+    }
+
+    ~WorkerPool()
+    {
+        {
+            lock_guard<mutex> lock(guard);
+            stopping = true;
+        }
+        ready.notify_all();
+        for (thread& worker : threads)
+        {
+            worker.join();
+        }
+    }
+
+    void submit(function<void()> task)
+    {
+        {
+            lock_guard<mutex> lock(guard);
+            tasks.push(move(task));
+        }
+        ready.notify_one();
+    }
+
+private:
+    void run()
+    {
+        while (true)
+        {
+            function<void()> task;
+            {
+                unique_lock<mutex> lock(guard);
+                ready.wait(lock, [this] { return stopping || !tasks.empty(); });
+                if (tasks.empty())
+                {
+                    return;
+                }
+                task = move(tasks.front());
+                tasks.pop();
+            }
+            worker_thread_limit = threads_per_task;
+            task();
+        }
+    }
+
+    vector<thread> threads;
+    queue<function<void()>> tasks;
+    mutex guard;
+    condition_variable ready;
+    bool stopping = false;
+    int threads_per_task;
+};
+
+// Serve one JSON request line and return the JSON response line.
+// Request: {"id": 1, "input": "in.bmp", "process": 2, "scaling_factor": 0.3, "output": "out.bmp"}
+// with "number" for process 5, "x_scale"/"y_scale" for process 6, "radius" for process 11
+// "sigma"/"amount" for processes 12 and 13, "scale" or "size" ("WxH") and "interpolation"
+// for process 16 and "angle", "interpolation" and "background" ("r,g,b") for process 17.
+// "crop" and "roi" take "x,y,width,height".
+// With a memory budget every request first reserves its working memory. succeeded tells
+// whether the output was written.
+string handle_server_request(const string& line, ImageCache& images, const ResultCache& cache, MemoryBudget* budget,
+                             bool& succeeded)
+{
+    chrono::steady_clock::time_point start = chrono::steady_clock::now();
+    succeeded = false;
+    map<string, JsonValue> fields;
+    if (!parse_json_object(line, fields))
+    {
+        return "{\"ok\":false,\"error\":\"Request must be a flat JSON object.\"}";
+    }
+
+    string response = "{";
+    if (fields.count("id"))
+    {
+        JsonValue id = fields["id"];
+        response += "\"id\":" + (id.is_string ? json_quote(id.text) : id.text) + ",";
+    }
+    auto fail = [&](const string& error)
+    {
+        return response + "\"ok\":false,\"error\":" + json_quote(error) + "}";
+    };
+
+    ProcessRequest request;
+    string input_filename = fields["input"].text;
+    string output_filename = fields["output"].text;
+    bool valid = true;
+    if (fields.count("process")) valid = valid && parse_int(fields["process"].text, request.process);
+    if (fields.count("scaling_factor")) valid = valid && parse_double(fields["scaling_factor"].text, request.scaling_factor);
+    if (fields.count("number")) valid = valid && parse_int(fields["number"].text, request.number);
+    if (fields.count("x_scale")) valid = valid && parse_int(fields["x_scale"].text, request.x_scale);
+    if (fields.count("y_scale")) valid = valid && parse_int(fields["y_scale"].text, request.y_scale);
+    if (fields.count("radius")) valid = valid && parse_int(fields["radius"].text, request.radius);
+    if (fields.count("sigma")) valid = valid && parse_double(fields["sigma"].text, request.sigma);
+    if (fields.count("amount")) valid = valid && parse_double(fields["amount"].text, request.amount);
+    if (fields.count("scale")) valid = valid && parse_double(fields["scale"].text, request.scale);
+    if (fields.count("size")) valid = valid && parse_size(fields["size"].text, request.target_width, request.target_height);
+    if (fields.count("interpolation")) valid = valid && parse_interpolation(fields["interpolation"].text, request.interpolation);
+    if (fields.count("angle")) valid = valid && parse_double(fields["angle"].text, request.angle);
+    if (fields.count("background")) valid = valid && parse_color(fields["background"].text, request.background);
+    if (fields.count("crop")) valid = valid && parse_region(fields["crop"].text, request.crop);
+    if (fields.count("roi")) valid = valid && parse_region(fields["roi"].text, request.roi);
+    if (!valid)
+    {
+        return fail("Parameters must be numbers, with sizes as WxH, colors as r,g,b and interpolation nearest, "
+                    "bilinear or bicubic.");
+    }
+    if (input_filename.empty() || output_filename.empty())
+    {
+        return fail("Both input and output are required.");
+    }
+    if (input_filename == output_filename)
+    {
+        return fail("Output filename cannot be the same as the input filename.");
+    }
+    string error = request_error(request);
+    if (!error.empty())
+    {
+        return fail(error);
+    }
+
+    string source = "decoded";
+    string key;
+    if (!cache.directory.empty())
+    {
+        key = cache_key(input_filename, request, output_filename);
+        if (fetch_cached_result(cache, key, output_filename))
+        {
+            source = "result_cache";
+        }
+    }
+    if (source != "result_cache")
+    {
+        detach_output(output_filename);
+    }
+
+    MemoryPlan plan;
+    if (source != "result_cache" && budget != nullptr &&
+        !plan_file_request(input_filename, output_filename, request, budget->total(), plan))
+    {
+        return fail("Could not read " + input_filename + " as an image.");
+    }
+    if (budget != nullptr && source != "result_cache")
+    {
+        // The reservation assumes the plan's thread count; the pool resets it for the next task
+        worker_thread_limit = plan.threads;
+    }
+    MemoryReservation reservation(budget, plan.estimate);
+
+    if (plan.streaming)
+    {
+        // Too big for the whole budget in memory
+        source = "streamed";
+        if (!stream_process(input_filename, output_filename, request, plan.strip_rows))
+        {
+            return fail("Failed to stream " + input_filename + " to " + output_filename + ".");
+        }
+        store_cached_result(cache, key, output_filename);
+    }
+    else if (source != "result_cache")
+    {
+        bool was_cached = false;
+        shared_ptr<const vector<vector<Pixel>>> image = images.get(input_filename, was_cached);
+        if (!image)
+        {
+            return fail("Could not read " + input_filename + " as an image.");
+        }
+        if (was_cached)
+        {
+            source = "image_cache";
+        }
+        if (!write_image_fast(output_filename, apply_process(*image, request)))
+        {
+            return fail("Failed to save the processed image to " + output_filename + ".");
+        }
+        store_cached_result(cache, key, output_filename);
+    }
+
+    double elapsed_ms = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+    ostringstream out;
+    out << response << "\"ok\":true,\"output\":" << json_quote(output_filename) << ",\"source\":\"" << source
+        << "\",\"ms\":" << fixed << setprecision(3) << elapsed_ms << "}";
+    succeeded = true;
+    return out.str();
+}
+
+string handle_server_request(const string& line, ImageCache& images, const ResultCache& cache, MemoryBudget* budget)
+{
+    bool succeeded;
+    return handle_server_request(line, images, cache, budget, succeeded);
+}
+
+#ifdef __unix__
+// Socket shared by a connection's reader and the workers answering its requests
+struct ServerConnection
+{
+    int fd;
+    mutex write_guard;
+
+    explicit ServerConnection(int fd) : fd(fd) {}
+    ~ServerConnection() { close(fd); }
+
+    void send_line(const string& line)
+    {
+        lock_guard<mutex> lock(write_guard);
+        string data = line + "\n";
+        size_t sent = 0;
+        while (sent < data.size())
+        {
+            ssize_t count = ::send(fd, data.data() + sent, data.size() - sent, MSG_NOSIGNAL);
+            if (count <= 0)
+            {
+                return;
+            }
+            sent = sent + count;
+        }
+    }
+};
+
+// Read request lines from one client and queue them on the pool
+void serve_connection(shared_ptr<ServerConnection> connection, WorkerPool& pool, ImageCache& images,
+                      const ResultCache& cache, MemoryBudget* budget)
+{
+    string pending;
+    char buffer[4096];
     while (true)
     {
-        cout << prompt;
-        cin >> output_filename;
-        if (output_filename == "Q" || output_filename == "q")
+        ssize_t count = recv(connection->fd, buffer, sizeof(buffer), 0);
+        if (count <= 0)
         {
-            cout << endl;
-            cout << "Thank you for using my program....Goodbye!" << endl;
-            cout << endl;
-            exit(0);
+            return;
         }
+        pending.append(buffer, count);
 
-        if (output_filename == "menu" || output_filename == "Menu" || output_filename == "MENU")
+        size_t newline;
+        while ((newline = pending.find('\n')) != string::npos)
         {
-            cout << endl;
-            cout << "Returning to menu..." << endl;
-            cout << endl;
-            menu(input_filename);
+            string line = pending.substr(0, newline);
+            pending.erase(0, newline + 1);
+            if (line.find_first_not_of(" \t\r") == string::npos)
+            {
+                continue;
+            }
+            pool.submit([connection, line, &images, &cache, budget]
+            {
+                connection->send_line(handle_server_request(line, images, cache, budget));
+            });
+        }
+    }
+}
+#endif
+
+// Serve requests until stdin closes, or forever on a Unix domain socket. Returns the exit code.
+int run_server(const CommandLine& command_line)
+{
+    int workers = command_line.workers;
+    if (workers <= 0)
+    {
+        workers = max(1u, thread::hardware_concurrency());
+    }
+    ImageCache images(command_line.image_cache_size);
+    unique_ptr<MemoryBudget> budget;
+    if (command_line.max_memory_mb > 0)
+    {
+        budget = make_unique<MemoryBudget>(command_line.max_memory_mb * 1048576LL - resident_memory("VmRSS:"));
+    }
+    // Declared before the pool so it outlives the tasks the pool finishes on destruction
+    mutex output_guard;
+    WorkerPool pool(workers, max(1, worker_thread_count() / workers));
+
+    if (command_line.socket_path.empty())
+    {
+        // Responses can arrive out of order, so clients match them up by id
+        string line;
+        while (getline(cin, line))
+        {
+            if (line.find_first_not_of(" \t\r") == string::npos)
+            {
+                continue;
+            }
+            pool.submit([line, &images, &command_line, &output_guard, &budget]
+            {
+                string response = handle_server_request(line, images, command_line.cache, budget.get());
+                lock_guard<mutex> lock(output_guard);
+                cout << response << endl;
+            });
         }
+        return 0;
+    }
+
+#ifdef __unix__
+    sockaddr_un address = {};
+    address.sun_family = AF_UNIX;
+    if (command_line.socket_path.size() >= sizeof(address.sun_path))
+    {
+        cerr << "Error: Socket path is too long." << endl;
+        return 1;
+    }
+    command_line.socket_path.copy(address.sun_path, sizeof(address.sun_path) - 1);
+
+    int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+    unlink(command_line.socket_path.c_str());
+    if (listener < 0 || bind(listener, (sockaddr*)&address, sizeof(address)) != 0 || listen(listener, 64) != 0)
+    {
+        cerr << "Error: Cannot listen on " << command_line.socket_path << "." << endl;
+        return 1;
+    }
+    cerr << "Listening on " << command_line.socket_path << " with " << workers << " workers" << endl;
 
-        if (output_filename.length() < 4 || output_filename.substr(output_filename.length() -4) != ".bmp")
+    while (true)
+    {
+        int client = accept(listener, nullptr, nullptr);
+        if (client < 0)
         {
-            cout << endl;
-            cout << "Error: Output file must be a .bmp file." << endl;
-            cout << endl;
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            break;
         }
-        else if (output_filename == input_filename)
+        shared_ptr<ServerConnection> connection = make_shared<ServerConnection>(client);
+        thread(serve_connection, connection, ref(pool), ref(images), cref(command_line.cache), budget.get()).detach();
+    }
+    close(listener);
+    return 1;
+#else
+    cerr << "Error: --socket is only supported on Unix systems." << endl;
+    return 1;
+#endif
+}
+
+// Run the shard of a batch manifest this worker owns. The manifest holds one request per line
+// in the --serve format; blank lines are skipped and do not count as items. Item i belongs to
+// shard i % K, or with --shard-by hash to shard hash(line) % K, so any number of processes on
+// any machines can each take a shard with no coordination beyond a shared filesystem. Every
+// finished item is appended to the shard's completion log under a hash of its line, and a
+// rerun skips items already in the log, so an interrupted shard resumes where it stopped and
+// an edited line runs again. Returns the exit code.
+int run_batch(const CommandLine& command_line)
+{
+    ifstream manifest(command_line.batch_filename);
+    if (!manifest.is_open())
+    {
+        cerr << "Error: Cannot read the manifest " << command_line.batch_filename << "." << endl;
+        return 1;
+    }
+    string log_filename = command_line.batch_log_filename;
+    if (log_filename.empty())
+    {
+        log_filename = command_line.batch_filename + ".shard-" + to_string(command_line.shard_index) + "-of-" +
+                       to_string(command_line.shard_count) + ".log";
+    }
+
+    // Keys of items finished by earlier runs. A line cut short by a crash has no whole key.
+    set<string> finished;
+    bool log_ends_line = true;
+    {
+        ifstream log(log_filename);
+        string entry;
+        while (getline(log, entry))
         {
-            cout << endl;
-            cout << "Error: Output filename cannot be the same as the input filename." << endl;
-            cout << endl;
+            string key = entry.substr(0, entry.find(' '));
+            if (key.size() == 16 && key.find_first_not_of("0123456789abcdef") == string::npos)
+            {
+                finished.insert(key);
+            }
+            log_ends_line = !log.eof();
         }
-        else
+    }
+    ofstream log(log_filename, ios::app);
+    if (!log.is_open())
+    {
+        cerr << "Error: Cannot write the completion log " << log_filename << "." << endl;
+        return 1;
+    }
+    if (!log_ends_line)
+    {
+        log << '\n';
+    }
+
+    int workers = command_line.workers;
+    if (workers <= 0)
+    {
+        workers = max(1u, thread::hardware_concurrency());
+    }
+    ImageCache images(command_line.image_cache_size);
+    unique_ptr<MemoryBudget> budget;
+    if (command_line.max_memory_mb > 0)
+    {
+        budget = make_unique<MemoryBudget>(command_line.max_memory_mb * 1048576LL - resident_memory("VmRSS:"));
+    }
+
+    int items = 0;
+    int in_shard = 0;
+    int skipped = 0;
+    int processed = 0;
+    int failed = 0;
+    mutex output_guard;
+    {
+        WorkerPool pool(workers, max(1, worker_thread_count() / workers));
+        string line;
+        while (getline(manifest, line))
         {
-            bool exists = false;
-            for (int i = 0; i < existing_outputs.size(); i++)
+            if (!line.empty() && line.back() == '\r')
             {
-                if (existing_outputs[i] == output_filename)
-                {
-                    exists = true;
-                    break;
-                }
+                line.pop_back();
             }
-            if (exists)
+            if (line.find_first_not_of(" \t") == string::npos)
             {
-                cout << endl;
-                cout << "Error: Output filename already exists." << endl;
-                cout << endl;
+                continue;
             }
-            else
+            int index = items++;
+            uint64_t hash = fnv1a(line.data(), line.size());
+            uint64_t owner = command_line.shard_by_hash ? hash % command_line.shard_count : index % command_line.shard_count;
+            if ((int)owner != command_line.shard_index)
             {
-                return output_filename;
+                continue;
             }
+            in_shard++;
+
+            ostringstream key_text;
+            key_text << hex << setw(16) << setfill('0') << hash;
+            string key = key_text.str();
+            if (!finished.insert(key).second)
+            {
+                // Done by an earlier run, or the same request earlier in this manifest
+                skipped++;
+                continue;
+            }
+
+            pool.submit([line, key, index, &images, &command_line, &budget, &output_guard, &log, &processed, &failed]
+            {
+                bool succeeded;
+                string response = handle_server_request(line, images, command_line.cache, budget.get(), succeeded);
+                lock_guard<mutex> lock(output_guard);
+                cout << response << endl;
+                if (succeeded)
+                {
+                    log << key << ' ' << index << endl;
+                    processed++;
+                }
+                else
+                {
+                    failed++;
+                }
+            });
         }
     }
+
+    clog << "batch shard " << command_line.shard_index << "/" << command_line.shard_count << ": " << in_shard
+         << " of " << items << " items, " << skipped << " already done, " << processed << " processed, " << failed
+         << " failed" << endl;
+    if (!log.good())
+    {
+        cerr << "Error: Failed to write the completion log " << log_filename << "." << endl;
+        return 1;
+    }
+    return failed > 0 ? 1 : 0;
 }
 
-// Ask for and verify number
-int get_valid_number(string prompt, int min_value, string input_filename)
+int main(int argc, char* argv[])
 {
-    string input;
-    int value;
-    while (true)
+    CommandLine command_line;
+    if (!parse_command_line(argc, argv, command_line))
     {
-        cout << prompt;
-        cin >> input;
-        if (input == "Q" || input == "q")
+        print_usage(argv[0]);
+        return 1;
+    }
+    const ResultCache& cache = command_line.cache;
+
+    if (!command_line.huge_pages.empty())
+    {
+#ifdef __linux__
+        if (enable_image_pool(command_line.huge_pages == "explicit"))
         {
-            cout << endl;
-            cout << "Thank you for using my program....Goodbye!" << endl;
-            cout << endl;
-            exit(0);
+            numa_node_cpus = read_numa_node_cpus();
         }
-
-        if (input == "menu" || input == "Menu" || input == "MENU")
+        else
         {
-            cout << endl;
-            cout << "Returning to menu..." << endl;
-            cout << endl;
-            menu(input_filename);
-            continue;
+            cerr << "Warning: Could not reserve memory for huge pages, using normal allocation." << endl;
         }
+#else
+        cerr << "Warning: --huge-pages is only supported on Linux, using normal allocation." << endl;
+#endif
+    }
 
-        value = stoi(input);
-
-        if (value >= min_value)
+    if (command_line.simd_info)
+    {
+        const PixelKernels& selected = pixel_kernels();
+        cout << "Available kernel levels:";
+        for (const PixelKernels* level : available_pixel_kernels())
         {
-            return value;
+            cout << " " << level->name;
         }
         cout << endl;
-        cout << "Error: Please enter a number greater than or equal to " << min_value << "." << endl;
-        cout << endl;
-        cin.clear();
-        cin.ignore(1000, '\n');
+        cout << "Using: " << selected.name << endl;
+        return 0;
     }
-}
 
-// Ask for and verify scaling factor
-double get_valid_scaling_factor(string prompt, double min_value, double max_value, string input_filename)
-{
-    string input;
-    double value;
-    while (true)
+    if (!command_line.stats_filename.empty())
     {
-        cout << prompt;
-        cin >> input;
-        if (input == "Q" || input == "q")
+        vector<vector<Pixel>> image = read_image_fast(command_line.stats_filename);
+        if (image.empty())
         {
-            cout << endl;
-            cout << "Thank you for using my program....Goodbye!" << endl;
-            cout << endl;
-            exit(0);
+            cerr << "Error: Could not read " << command_line.stats_filename << " as an image." << endl;
+            return 1;
         }
+        print_image_stats(compute_image_stats(image));
+        return 0;
+    }
 
-        if (input == "menu" || input == "Menu" || input == "MENU")
-        {
-            cout << endl;
-            cout << "Returning to menu..." << endl;
-            cout << endl;
-            menu(input_filename);
-            continue;
-        }
+    if (!command_line.compare_first.empty())
+    {
+        return run_compare(command_line);
+    }
 
-        value = stod(input);
+    if (command_line.verify)
+    {
+        return run_verify(command_line);
+    }
 
-        if (value > min_value && value < max_value)
-        {
-            return value;
-        }
-        cout << endl;
-        cout << "Error: Please enter a number between " << min_value << " and " << max_value << "." << endl;
-        cout << endl;
-        cin.clear();
-        cin.ignore(1000, '\n');
+    if (!command_line.codec_bench_filename.empty())
+    {
+        return run_codec_benchmark(command_line);
     }
-}
 
+    if (command_line.serve)
+    {
+        return run_server(command_line);
+    }
 
+    if (!command_line.batch_filename.empty())
+    {
+        return run_batch(command_line);
+    }
+
+    if (!command_line.input_filename.empty())
+    {
+        int status = run_command_line(command_line);
+        if (command_line.cache_stats && !cache.directory.empty())
+        {
+            print_cache_stats(cache);
+        }
+        return status;
+    }
 
-int main()
-{
     cout << endl;
     cout << "CSPB 1300 Image Processing Application" << endl;
     cout << endl;
     string filename;
     filename = get_valid_filename("Please enter a filename (.bmp only): ");
 
-    vector<vector<Pixel>> image = read_image(filename);
-    vector<vector<Pixel>> new_image;
+    vector<vector<Pixel>> image = read_image_fast(filename);
+    vector<vector<Pixel>> preview;
+    int preview_factor = make_preview(image, preview);
     vector<string> output_filenames;
 
     string selection;
@@ -854,6 +6444,13 @@ int main()
     string lighten_output;
     string darken_output;
     string color_output;
+    string blur_output;
+    string gaussian_output;
+    string sharpen_output;
+    string levels_output;
+    string equalize_output;
+    string resample_output;
+    string rotate_angle_output;
 
     while (true)
     {
@@ -862,11 +6459,12 @@ int main()
         if (selection != "0" && selection != "1" && selection != "2" && selection != "3" && selection != "4" &&
             selection
             != "5" && selection != "6" && selection != "7" && selection != "8" && selection != "9" && selection != "10"
-            &&
-            selection != "Q" && selection != "q")
+            && selection != "11" && selection != "12" && selection != "13" && selection != "14" && selection != "15" &&
+            selection != "16" && selection != "17" && selection != "P" && selection != "p" && selection != "Q" &&
+            selection != "q")
         {
             cout << endl;
-            cout << "Error. Input must be between 0-10 or Q/q to quit." << endl;
+            cout << "Error. Input must be between 0-17, P/p to preview or Q/q to quit." << endl;
             cout << endl;
         }
 
@@ -882,7 +6480,17 @@ int main()
         if (selection == "0")
         {
             filename = get_valid_filename("Please enter a filename (.bmp only): ");
-            image = read_image(filename);
+            image = read_image_fast(filename);
+            preview_factor = make_preview(image, preview);
+        }
+
+        // UI if user selects option "P"
+        else if (selection == "P" || selection == "p")
+        {
+            cout << endl;
+            cout << "Preview selected" << endl;
+            cout << endl;
+            run_preview(filename, image, preview, preview_factor, output_filenames, cache);
         }
 
         // UI if user selects option "1"
@@ -895,8 +6503,9 @@ int main()
             output_filenames.push_back(vignette_output);
 
             // Runs the proper process and writes the image to user provided output file.
-            new_image = process_1(image);
-            if (write_image(vignette_output, new_image))
+            ProcessRequest request;
+            request.process = 1;
+            if (process_and_save(filename, image, request, vignette_output, cache))
             {
                 cout << endl;
                 cout << "Successfully applied vignette and saved to " << vignette_output << "!" << endl;
@@ -921,8 +6530,10 @@ int main()
             double scaling_factor = get_valid_scaling_factor("Enter scaling factor: ", 0.0, 1.0, filename);
 
             // Runs the proper process and writes the image to user provided output file.
-            new_image = process_2(image, scaling_factor);
-            if (write_image(clarendon_output, new_image))
+            ProcessRequest request;
+            request.process = 2;
+            request.scaling_factor = scaling_factor;
+            if (process_and_save(filename, image, request, clarendon_output, cache))
             {
                 cout << endl;
                 cout << "Successfully applied clarendon and saved to " << clarendon_output << "!" << endl;
@@ -944,8 +6555,9 @@ int main()
             output_filenames.push_back(grayscale_output);
 
             // Runs the proper process and writes the image to user provided output file.
-            new_image = process_3(image);
-            if (write_image(grayscale_output, new_image))
+            ProcessRequest request;
+            request.process = 3;
+            if (process_and_save(filename, image, request, grayscale_output, cache))
             {
                 cout << endl;
                 cout << "Successfully applied grayscale and saved to " << grayscale_output << "!" << endl;
@@ -967,8 +6579,9 @@ int main()
             output_filenames.push_back(rotate_output);
 
             // Runs the proper process and writes the image to user provided output file.
-            new_image = process_4(image);
-            if (write_image(rotate_output, new_image))
+            ProcessRequest request;
+            request.process = 4;
+            if (process_and_save(filename, image, request, rotate_output, cache))
             {
                 cout << endl;
                 cout << "Successfully applied rotate 90 degrees and saved to " << rotate_output << "!" << endl;
@@ -992,8 +6605,10 @@ int main()
             int number = get_valid_number("Enter a number: ", 1, filename);
 
             // Runs the proper process and writes the image to user provided output file.
-            new_image = process_5(image, number);
-            if (write_image(rotate_multiple_output, new_image))
+            ProcessRequest request;
+            request.process = 5;
+            request.number = number;
+            if (process_and_save(filename, image, request, rotate_multiple_output, cache))
             {
                 cout << endl;
                 cout << "Successfully applied rotate 90 degrees multiple times and saved to " << rotate_multiple_output << "!" << endl;
@@ -1018,8 +6633,11 @@ int main()
             int y_scale = get_valid_number("Enter another number: ", 1, filename);
 
             // Runs the proper process and writes the image to user provided output file.
-            new_image = process_6(image, x_scale, y_scale);
-            if (write_image(enlarge_output, new_image))
+            ProcessRequest request;
+            request.process = 6;
+            request.x_scale = x_scale;
+            request.y_scale = y_scale;
+            if (process_and_save(filename, image, request, enlarge_output, cache))
             {
                 cout << endl;
                 cout << "Successfully applied enlarge and saved to " << enlarge_output << "!" << endl;
@@ -1041,8 +6659,9 @@ int main()
             output_filenames.push_back(contrast_output);
 
             // Runs the proper process and writes the image to user provided output file.
-            new_image = process_7(image);
-            if (write_image(contrast_output, new_image))
+            ProcessRequest request;
+            request.process = 7;
+            if (process_and_save(filename, image, request, contrast_output, cache))
             {
                 cout << endl;
                 cout << "Successfully applied high contrast and saved to " << contrast_output << "!" << endl;
@@ -1066,8 +6685,10 @@ int main()
             double scaling_factor = get_valid_scaling_factor("Enter scaling factor: ", 0.0, 1.0, filename);
 
             // Runs the proper process and writes the image to user provided output file.
-            new_image = process_8(image, scaling_factor);
-            if (write_image(lighten_output, new_image))
+            ProcessRequest request;
+            request.process = 8;
+            request.scaling_factor = scaling_factor;
+            if (process_and_save(filename, image, request, lighten_output, cache))
             {
                 cout << endl;
                 cout << "Successfully applied lighten and saved to " << lighten_output << "!" << endl;
@@ -1091,8 +6712,10 @@ int main()
             double scaling_factor = get_valid_scaling_factor("Enter scaling factor: ", 0.0, 1.0, filename);
 
             // Runs the proper process and writes the image to user provided output file.
-            new_image = process_9(image, scaling_factor);
-            if (write_image(darken_output, new_image))
+            ProcessRequest request;
+            request.process = 9;
+            request.scaling_factor = scaling_factor;
+            if (process_and_save(filename, image, request, darken_output, cache))
             {
                 cout << endl;
                 cout << "Successfully applied darken and saved to " << darken_output << "!" << endl;
@@ -1114,8 +6737,9 @@ int main()
             output_filenames.push_back(color_output);
 
             // Runs the proper process and writes the image to user provided output file.
-            new_image = process_10(image);
-            if (write_image(color_output, new_image))
+            ProcessRequest request;
+            request.process = 10;
+            if (process_and_save(filename, image, request, color_output, cache))
             {
                 cout << endl;
                 cout << "Successfully applied colors and saved to " << color_output << "!" << endl;
@@ -1126,7 +6750,198 @@ int main()
                 cout << "Error: Failed to save the processed image to " << color_output << "." << endl;
             }
         }
+
+        // UI if user selects option "11"
+        else if (selection == "11")
+        {
+            cout << endl;
+            cout << "Box Blur selected" << endl;
+            cout << endl;
+            blur_output = get_output_filename(filename, output_filenames, "Enter output filename (.bmp only), (Type Q/q to quit, menu to return to menu): ");
+            output_filenames.push_back(blur_output);
+
+            int radius = get_valid_number("Enter blur radius: ", 1, filename);
+
+            // Runs the proper process and writes the image to user provided output file.
+            ProcessRequest request;
+            request.process = 11;
+            request.radius = min(radius, 1000);
+            if (process_and_save(filename, image, request, blur_output, cache))
+            {
+                cout << endl;
+                cout << "Successfully applied box blur and saved to " << blur_output << "!" << endl;
+            }
+            else
+            {
+                cout << endl;
+                cout << "Error: Failed to save the processed image to " << blur_output << "." << endl;
+            }
+        }
+
+        // UI if user selects option "12"
+        else if (selection == "12")
+        {
+            cout << endl;
+            cout << "Gaussian Blur selected" << endl;
+            cout << endl;
+            gaussian_output = get_output_filename(filename, output_filenames, "Enter output filename (.bmp only), (Type Q/q to quit, menu to return to menu): ");
+            output_filenames.push_back(gaussian_output);
+
+            double sigma = get_valid_scaling_factor("Enter sigma: ", 0.0, 200.0, filename);
+
+            // Runs the proper process and writes the image to user provided output file.
+            ProcessRequest request;
+            request.process = 12;
+            request.sigma = sigma;
+            if (process_and_save(filename, image, request, gaussian_output, cache))
+            {
+                cout << endl;
+                cout << "Successfully applied gaussian blur and saved to " << gaussian_output << "!" << endl;
+            }
+            else
+            {
+                cout << endl;
+                cout << "Error: Failed to save the processed image to " << gaussian_output << "." << endl;
+            }
+        }
+
+        // UI if user selects option "13"
+        else if (selection == "13")
+        {
+            cout << endl;
+            cout << "Sharpen selected" << endl;
+            cout << endl;
+            sharpen_output = get_output_filename(filename, output_filenames, "Enter output filename (.bmp only), (Type Q/q to quit, menu to return to menu): ");
+            output_filenames.push_back(sharpen_output);
+
+            double sigma = get_valid_scaling_factor("Enter sigma: ", 0.0, 200.0, filename);
+            double amount = get_valid_scaling_factor("Enter amount: ", 0.0, 10.0, filename);
+
+            // Runs the proper process and writes the image to user provided output file.
+            ProcessRequest request;
+            request.process = 13;
+            request.sigma = sigma;
+            request.amount = amount;
+            if (process_and_save(filename, image, request, sharpen_output, cache))
+            {
+                cout << endl;
+                cout << "Successfully applied sharpen and saved to " << sharpen_output << "!" << endl;
+            }
+            else
+            {
+                cout << endl;
+                cout << "Error: Failed to save the processed image to " << sharpen_output << "." << endl;
+            }
+        }
+
+        // UI if user selects option "14"
+        else if (selection == "14")
+        {
+            cout << endl;
+            cout << "Auto Levels selected" << endl;
+            cout << endl;
+            levels_output = get_output_filename(filename, output_filenames, "Enter output filename (.bmp only), (Type Q/q to quit, menu to return to menu): ");
+            output_filenames.push_back(levels_output);
+
+            // Runs the proper process and writes the image to user provided output file.
+            ProcessRequest request;
+            request.process = 14;
+            if (process_and_save(filename, image, request, levels_output, cache))
+            {
+                cout << endl;
+                cout << "Successfully applied auto levels and saved to " << levels_output << "!" << endl;
+            }
+            else
+            {
+                cout << endl;
+                cout << "Error: Failed to save the processed image to " << levels_output << "." << endl;
+            }
+        }
+
+        // UI if user selects option "15"
+        else if (selection == "15")
+        {
+            cout << endl;
+            cout << "Equalize selected" << endl;
+            cout << endl;
+            equalize_output = get_output_filename(filename, output_filenames, "Enter output filename (.bmp only), (Type Q/q to quit, menu to return to menu): ");
+            output_filenames.push_back(equalize_output);
+
+            // Runs the proper process and writes the image to user provided output file.
+            ProcessRequest request;
+            request.process = 15;
+            if (process_and_save(filename, image, request, equalize_output, cache))
+            {
+                cout << endl;
+                cout << "Successfully applied equalize and saved to " << equalize_output << "!" << endl;
+            }
+            else
+            {
+                cout << endl;
+                cout << "Error: Failed to save the processed image to " << equalize_output << "." << endl;
+            }
+        }
+
+        // UI if user selects option "16"
+        else if (selection == "16")
+        {
+            cout << endl;
+            cout << "Resample selected" << endl;
+            cout << endl;
+            resample_output = get_output_filename(filename, output_filenames, "Enter output filename (.bmp only), (Type Q/q to quit, menu to return to menu): ");
+            output_filenames.push_back(resample_output);
+
+            double scale = get_valid_scaling_factor("Enter scale factor: ", 0.0, 100.0, filename);
+            Interpolation interpolation = get_valid_interpolation("Enter interpolation (nearest, bilinear, bicubic): ", filename);
+
+            // Runs the proper process and writes the image to user provided output file.
+            ProcessRequest request;
+            request.process = 16;
+            request.scale = scale;
+            request.interpolation = interpolation;
+            if (process_and_save(filename, image, request, resample_output, cache))
+            {
+                cout << endl;
+                cout << "Successfully applied resample and saved to " << resample_output << "!" << endl;
+            }
+            else
+            {
+                cout << endl;
+                cout << "Error: Failed to save the processed image to " << resample_output << "." << endl;
+            }
+        }
+
+        // UI if user selects option "17"
+        else if (selection == "17")
+        {
+            cout << endl;
+            cout << "Rotate by Angle selected" << endl;
+            cout << endl;
+            rotate_angle_output = get_output_filename(filename, output_filenames, "Enter output filename (.bmp only), (Type Q/q to quit, menu to return to menu): ");
+            output_filenames.push_back(rotate_angle_output);
+
+            double angle = get_valid_scaling_factor("Enter angle in degrees: ", -360.0, 360.0, filename);
+
+            // Runs the proper process and writes the image to user provided output file.
+            ProcessRequest request;
+            request.process = 17;
+            request.angle = angle;
+            if (process_and_save(filename, image, request, rotate_angle_output, cache))
+            {
+                cout << endl;
+                cout << "Successfully applied rotate by angle and saved to " << rotate_angle_output << "!" << endl;
+            }
+            else
+            {
+                cout << endl;
+                cout << "Error: Failed to save the processed image to " << rotate_angle_output << "." << endl;
+            }
+        }
     }
 
+    if (command_line.cache_stats && !cache.directory.empty())
+    {
+        print_cache_stats(cache);
+    }
     return 0;
 }
\ No newline at end of file